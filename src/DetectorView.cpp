@@ -19,6 +19,7 @@
 #include "Refine.h"
 #include "DetectorView.h"
 #include "SlipPanel.h"
+#include "PanelView.h"
 #include "Overview.h"
 #include "Line.h"
 #include "CurveView.h"
@@ -27,6 +28,7 @@
 #include <iostream>
 #include <QSlider>
 #include <QThread>
+#include <QMessageBox>
 #include <RefinementNelderMead.h>
 
 #define PAN_SENSITIVITY 3
@@ -38,8 +40,10 @@ DetectorView::DetectorView(QWidget *p) : QWidget(p)
 	_worker = NULL;
 	_mouseButton = Qt::NoButton;
 	_allPanels = NULL;
+	_overview = NULL;
 	_selected = new SlipPanel();
 	_selected->setSelected(true);
+	_selected->setAcceptHandler(DetectorView::handleAccept, this);
 	_controlPressed = false;
 	_moving = false;
 	_lastX = -1;
@@ -60,11 +64,12 @@ void DetectorView::resizeEvent(QResizeEvent *event)
 
 void DetectorView::setDetector(struct detector *det, bool refresh)
 {
-	for (size_t i = 0; i < _panels.size(); i++)
+	for (size_t i = 0; i < _views.size(); i++)
 	{
-		_gl->removeObject(_panels[i]);
+		_gl->removeObject(_views[i]);
 	}
 
+	_views.clear();
 	_panels.clear();
 
 	if (_det != NULL)
@@ -77,17 +82,18 @@ void DetectorView::setDetector(struct detector *det, bool refresh)
 	_gl->preparePanels(_det->n_panels);
 	double ave_d = 0;
 	_allPanels = new SlipPanel();
-	_allPanels->setOverview(_overview);
+	_allPanels->setAcceptHandler(DetectorView::handleAccept, this);
 	_selected->clearPanels();
 
 	for (int i = 0; i < _det->n_panels; i++)
 	{
 		struct panel *p = &(_det->panels[i]);
 
-		SlipPanel *spanel = new SlipPanel(p);
-		spanel->setOverview(_overview);
+		SlipPanel *spanel = new SlipPanel(p, i);
+		PanelView *view = new PanelView(spanel);
 		_panels.push_back(spanel);
-		_gl->addObject(spanel, false);
+		_views.push_back(view);
+		_gl->addObject(view, false);
 
 		double d = 1000 *  (p->clen + p->coffset);
 		ave_d += d;
@@ -121,14 +127,14 @@ void DetectorView::setDetector(struct detector *det, bool refresh)
 	_gl->update();
 }
 
-void DetectorView::imageToPanels(struct image *im)
+void DetectorView::imagesToPanels(size_t end)
 {
 	for (size_t i = 0; i < _panels.size(); i++)
 	{
-		_panels[i]->getPeaksFromImage(im);
+		_panels[i]->addImages(end);
 	}
 	
-	_allPanels->getPeaksFromImage(im);
+	_allPanels->addImages(end);
 }
 
 void DetectorView::keyPressEvent(QKeyEvent *event)
@@ -166,18 +172,18 @@ void DetectorView::mouseReleaseEvent(QMouseEvent *e)
 	SlipPanel *closest = NULL;
 	double z = -FLT_MAX;
 
-	for (size_t i = 0; i < _panels.size(); i++)
+	for (size_t i = 0; i < _views.size(); i++)
 	{
-		if (_panels[i]->intersectsPolygon(x, y, &z))
+		if (_views[i]->intersectsPolygon(x, y, &z))
 		{
-			closest = _panels[i];
+			closest = _views[i]->panel();
 		}
 	}
 
 	if (closest)
 	{
 		_selected->togglePanel(closest);
-		_overview->supplyImagesToPanel(_selected);
+		_overview->topUpPanel(_selected);
 		_selected->acceptNudges();
 	}
 	else
@@ -260,7 +266,6 @@ void DetectorView::setDistanceAllPanels(double metres)
 		SlipPanel *p = getPanel(i);
 		p->addToZ(add);
 		p->updateTmpPanelValues();
-		p->updateVertices();
 	}
 	
 	_lastMetres = metres;
@@ -302,18 +307,50 @@ void DetectorView::updateGlobalDetectorDistance()
 
 void DetectorView::updateTargetPattern()
 {
-	if (_targetCurve->getCurveView()->isVisible())
+	if (!_targetCurve->getCurveView()->isVisible())
+	{
+		return;
+	}
+
+	SlipPanel *panel = activePanel();
+	panel->prepareTarget(true);
+
+	_targetCurve->clear();
+	_targetCurve->setPointData(true);
+
+	for (size_t i = 0; i < panel->targetCount(); i++)
 	{
-		activePanel()->updateTarget(_targetCurve, true);
+		_targetCurve->addDataPoint(panel->targetX(i), panel->targetY(i));
 	}
+
+	_targetCurve->getCurveView()->redraw();
 }
 
 void DetectorView::updatePowderPattern()
 {
-	if (_powderCurve->getCurveView()->isVisible())
+	if (!_powderCurve->getCurveView()->isVisible())
+	{
+		return;
+	}
+
+	/* kept between calls, so the bins aren't reallocated */
+	activePanel()->updatePowder(&_powder, true);
+
+	_powderCurve->clear();
+	double max = 0;
+	for (size_t i = 0; i < _powder.size(); i++)
 	{
-		activePanel()->updatePowder(_powderCurve, true);
+		_powderCurve->addDataPoint((double)i * POWDER_SLICING, _powder[i]);
+		
+		if (_powder[i] > max)
+		{
+			max = _powder[i];
+		}
 	}
+	
+	CurveView *cv = _powderCurve->getCurveView();
+	cv->setWindow(-POWDER_RANGE/10, -max/10, POWDER_RANGE, max*1.1);
+	cv->redraw();
 }
 
 SlipPanel *DetectorView::activePanel()
@@ -335,19 +372,22 @@ DetectorView::~DetectorView()
 void DetectorView::setOverview(Overview *over)
 {
 	_overview = over;
-	
-	for (size_t i = 0; i < _panels.size(); i++)
+}
+
+void DetectorView::handleAccept(void *object)
+{
+	DetectorView *me = static_cast<DetectorView *>(object);
+
+	if (me->_overview != NULL)
 	{
-		getPanel(i)->setOverview(over);
+		me->_overview->resetSliders();
 	}
-
-	_selected->setOverview(_overview);
 }
 
 void DetectorView::clearPanelScratch()
 {
 	_allPanels->clearImageData();
-	activePanel()->clearImageData();
+	_selected->clearImageData();
 	
 	for (size_t i = 0; i < _panels.size(); i++)
 	{
@@ -356,6 +396,11 @@ void DetectorView::clearPanelScratch()
 
 }
 
+bool DetectorView::isRefining()
+{
+	return (_worker != NULL && _worker->isRunning());
+}
+
 void DetectorView::intraPanel()
 {
 	refinePanel(true);
@@ -367,6 +412,16 @@ void DetectorView::refinePanel(bool intra)
 	{
 		return;
 	}
+
+	/* each batch rebuilds the stores the refinement would read */
+	if (_overview != NULL && _overview->isLoading())
+	{
+		QMessageBox msgBox;
+		msgBox.setText(tr("Wait for the stream to finish loading "
+		                  "before refining."));
+		msgBox.exec();
+		return;
+	}
 	
 	if (!_worker)
 	{
@@ -26,6 +26,7 @@
 #include <QMouseEvent>
 
 class SlipPanel;
+class PanelView;
 class Refine;
 class QSlider;
 class Curve;
@@ -46,7 +47,7 @@ public:
 	
 	void clearPanelScratch();
 	void setDetector(struct detector *det, bool refresh = false);
-	void imageToPanels(struct image *im);
+	void imagesToPanels(size_t end);
 	void updateSlider(QSlider *s);
 	void setDistanceAllPanels(double metres);
 	SlipPanel *activePanel();
@@ -57,6 +58,10 @@ public:
 	}
 	
 	void setOverview(Overview *over);
+	static void handleAccept(void *object);
+
+	/* the worker reads the session's stores while this is true */
+	bool isRefining();
 	
 	void setTargetCurve(Curve *curve)
 	{
@@ -101,6 +106,7 @@ private:
 	struct detector *_det;
 	SlipGL *_gl;
 	std::vector<SlipPanel *> _panels;
+	std::vector<PanelView *> _views;
 	SlipPanel *_allPanels;
 	SlipPanel *_selected;
 	double _origDist;
@@ -108,6 +114,7 @@ private:
 	
 	Overview *_overview;
 	Curve *_powderCurve;
+	std::vector<double> _powder;
 	Curve *_targetCurve;
 	Qt::MouseButton _mouseButton;
 	bool _controlPressed;
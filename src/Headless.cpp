@@ -0,0 +1,381 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "Headless.h"
+#include "Session.h"
+#include "StreamLoader.h"
+#include "Predictor.h"
+#include "SlipPanel.h"
+#include "Refiner.h"
+#include "thread_utils.h"
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <crystfel/geometry.h>
+
+static bool is_option(const char *arg)
+{
+	const char *opts[] = {"--geom", "--stream", "--refine", "--panels",
+	                      "-o", "--max-images", "--min-intensity",
+	                      "--intra-cutoff", "--threads", "--no-cache",
+	                      NULL};
+
+	for (int i = 0; opts[i] != NULL; i++)
+	{
+		if (strcmp(arg, opts[i]) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static std::vector<std::string> split_commas(std::string str)
+{
+	std::vector<std::string> parts;
+	std::stringstream ss(str);
+	std::string part;
+
+	while (std::getline(ss, part, ','))
+	{
+		if (part.length())
+		{
+			parts.push_back(part);
+		}
+	}
+
+	return parts;
+}
+
+/* a whole number above zero, and nothing after it */
+static bool parse_count(std::string str, size_t *count)
+{
+	char *end = NULL;
+	errno = 0;
+	long val = strtol(str.c_str(), &end, 10);
+
+	if (str.length() == 0 || *end != '\0' || errno != 0 || val <= 0)
+	{
+		return false;
+	}
+
+	*count = val;
+	return true;
+}
+
+static void print_usage()
+{
+	std::cout << "Usage: slipnslide --geom in.geom --stream run.stream"
+	" --refine inter,intra --panels all|each|name,... -o out.geom"
+	<< std::endl;
+}
+
+Headless::Headless(int argc, char *argv[])
+{
+	_maxImages = 20;
+	_minIntensity = 200;
+	_intraCutoff = INTRA_CUTOFF;
+	_threads = thread_count();
+	_useCache = true;
+	_panels = "all";
+	_det = NULL;
+	_session = new Session();
+
+	_valid = parseArgs(argc, argv);
+}
+
+Headless::~Headless()
+{
+	for (size_t i = 0; i < _groups.size(); i++)
+	{
+		delete _groups[i];
+	}
+
+	for (size_t i = 0; i < _singles.size(); i++)
+	{
+		delete _singles[i];
+	}
+
+	delete _session;
+
+	if (_det != NULL)
+	{
+		free_detector_geometry(_det);
+	}
+}
+
+bool Headless::requested(int argc, char *argv[])
+{
+	for (int i = 1; i < argc; i++)
+	{
+		if (is_option(argv[i]))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool Headless::parseArgs(int argc, char *argv[])
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+
+		if (arg == "--no-cache")
+		{
+			_useCache = false;
+			continue;
+		}
+
+		if (!is_option(argv[i]) || i + 1 >= argc)
+		{
+			std::cout << "Unexpected argument: " << arg << std::endl;
+			print_usage();
+			return false;
+		}
+
+		std::string val = argv[++i];
+
+		if (arg == "--geom")
+		{
+			_geomFile = val;
+		}
+		else if (arg == "--stream")
+		{
+			_streamFile = val;
+		}
+		else if (arg == "-o")
+		{
+			_outFile = val;
+		}
+		else if (arg == "--panels")
+		{
+			_panels = val;
+		}
+		else if (arg == "--max-images")
+		{
+			if (!parse_count(val, &_maxImages))
+			{
+				std::cout << "--max-images needs a number above zero, "
+				"not " << val << std::endl;
+				print_usage();
+				return false;
+			}
+		}
+		else if (arg == "--min-intensity")
+		{
+			_minIntensity = atof(val.c_str());
+		}
+		else if (arg == "--intra-cutoff")
+		{
+			_intraCutoff = atof(val.c_str());
+		}
+		else if (arg == "--threads")
+		{
+			if (!parse_count(val, &_threads))
+			{
+				std::cout << "--threads needs a number above zero, "
+				"not " << val << std::endl;
+				print_usage();
+				return false;
+			}
+		}
+		else if (arg == "--refine")
+		{
+			std::vector<std::string> steps = split_commas(val);
+
+			if (steps.size() == 0)
+			{
+				std::cout << "--refine needs at least one of inter, intra"
+				<< std::endl;
+				print_usage();
+				return false;
+			}
+
+			for (size_t j = 0; j < steps.size(); j++)
+			{
+				if (steps[j] != "intra" && steps[j] != "inter")
+				{
+					std::cout << "Unknown refinement: " << steps[j]
+					<< std::endl;
+					print_usage();
+					return false;
+				}
+
+				_steps.push_back(steps[j] == "intra");
+			}
+		}
+	}
+
+	if (_geomFile.length() == 0 || _streamFile.length() == 0 ||
+	    _outFile.length() == 0)
+	{
+		print_usage();
+		return false;
+	}
+
+	return true;
+}
+
+bool Headless::makeGroups()
+{
+	for (int i = 0; i < _det->n_panels; i++)
+	{
+		_singles.push_back(new SlipPanel(&_det->panels[i], i));
+	}
+
+	if (_panels == "each")
+	{
+		for (size_t i = 0; i < _singles.size(); i++)
+		{
+			SlipPanel *group = new SlipPanel();
+			group->addPanel(_singles[i]);
+			_groups.push_back(group);
+		}
+
+		return true;
+	}
+
+	SlipPanel *group = new SlipPanel();
+	_groups.push_back(group);
+
+	if (_panels == "all")
+	{
+		for (size_t i = 0; i < _singles.size(); i++)
+		{
+			group->addPanel(_singles[i]);
+		}
+
+		return true;
+	}
+
+	std::vector<std::string> names = split_commas(_panels);
+
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		struct panel *p = find_panel_by_name(_det, names[i].c_str());
+
+		if (p == NULL)
+		{
+			std::cout << "No panel called " << names[i] << std::endl;
+			return false;
+		}
+
+		group->addPanel(_singles[p - _det->panels]);
+	}
+
+	return true;
+}
+
+void Headless::refineGroup(SlipPanel *group)
+{
+	group->clearImageData();
+	group->addImages(_session->imageCount());
+
+	for (size_t i = 0; i < _steps.size(); i++)
+	{
+		Refiner refiner(group, _steps[i]);
+		refiner.refine();
+		group->acceptNudges();
+	}
+}
+
+bool Headless::writeGeometry()
+{
+	double d = _det->defaults.clen;
+	for (size_t i = 0; i < _singles.size(); i++)
+	{
+		_singles[i]->cLenToOffset(d);
+	}
+
+	int err = write_detector_geometry_2(_geomFile.c_str(), _outFile.c_str(),
+	                                    _det,
+	                                    "refined by slip-and-slide algorithm, "\
+	                                    "J. Synchrotron Rad. (2017). 24, 1152-1162", 1);
+
+	for (size_t i = 0; i < _singles.size(); i++)
+	{
+		_singles[i]->cOffsetToLen(d);
+	}
+
+	return (err == 0);
+}
+
+int Headless::run()
+{
+	if (!_valid)
+	{
+		return 1;
+	}
+
+	_det = get_detector_geometry(_geomFile.c_str(), NULL);
+
+	if (_det == NULL)
+	{
+		std::cout << "Loading geometry file failed." << std::endl;
+		return 1;
+	}
+
+	StreamLoader loader(_streamFile, _det);
+	loader.setThreads(_threads);
+	loader.setUseCache(_useCache);
+
+	if (!loader.load(_session))
+	{
+		std::cout << "Loading stream file failed." << std::endl;
+		return 1;
+	}
+
+	Predictor predictor(_det);
+	predictor.setThreads(_threads);
+	predictor.repredict(_session, 0, false);
+
+	if (!makeGroups())
+	{
+		return 1;
+	}
+
+	SlipPanel::setMaxImages(_maxImages);
+	SlipPanel::setMinIntensity(_minIntensity);
+	SlipPanel::setIntraCutoff(_intraCutoff);
+	SlipPanel::setThreads(_threads);
+	_session->peaks()->update(_session, true);
+	SlipPanel::setPeakStore(_session->peaks());
+	SlipPanel::setReflectionStore(_session->reflections());
+
+	for (size_t i = 0; i < _groups.size(); i++)
+	{
+		std::cout << "Refining " << _groups[i]->shortDesc() << std::endl;
+		refineGroup(_groups[i]);
+	}
+
+	if (!writeGeometry())
+	{
+		std::cout << "Writing geometry file failed." << std::endl;
+		return 1;
+	}
+
+	std::cout << "Written out geometry file to " << _outFile << std::endl;
+
+	return 0;
+}
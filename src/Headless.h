@@ -0,0 +1,72 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __slipnslide__Headless__
+#define __slipnslide__Headless__
+
+#include <string>
+#include <vector>
+#include <crystfel/detector.h>
+
+class SlipPanel;
+class Session;
+
+/* Batch refinement from the command line, without a window:
+ *
+ *   slipnslide --geom in.geom --stream run.stream --refine inter,intra
+ *              --panels all|each|name,name,... -o out.geom
+ *
+ * Optional: --max-images N (default 20, as in the window),
+ * --min-intensity ADU (default 200), --intra-cutoff PIXELS (default 6),
+ * --threads N, --no-cache.
+ * Refinement steps run in the order given, on each panel group in turn. */
+
+class Headless
+{
+public:
+	Headless(int argc, char *argv[]);
+	~Headless();
+
+	static bool requested(int argc, char *argv[]);
+
+	int run();
+private:
+	bool parseArgs(int argc, char *argv[]);
+	bool makeGroups();
+	void refineGroup(SlipPanel *group);
+	bool writeGeometry();
+
+	bool _valid;
+	std::string _geomFile;
+	std::string _streamFile;
+	std::string _outFile;
+	std::string _panels;
+	std::vector<bool> _steps;
+	size_t _maxImages;
+	double _minIntensity;
+	double _intraCutoff;
+	size_t _threads;
+	bool _useCache;
+
+	struct detector *_det;
+	Session *_session;
+	std::vector<SlipPanel *> _singles;
+	std::vector<SlipPanel *> _groups;
+};
+
+#endif
@@ -0,0 +1,80 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "ImageStore.h"
+#include <stdlib.h>
+#include <crystfel/utils.h>
+
+ImageStore::ImageStore()
+{
+	_size = 0;
+}
+
+ImageStore::~ImageStore()
+{
+	clear();
+}
+
+void ImageStore::reserve(size_t n)
+{
+	while (_blocks.size() * IMAGE_BLOCK_SIZE < n)
+	{
+		struct image *block;
+		block = (struct image *)calloc(IMAGE_BLOCK_SIZE, 
+		                               sizeof(struct image));
+		if (block == NULL)
+		{
+			ERROR("Failed to allocate memory for images.\n");
+			abort();
+		}
+
+		_blocks.push_back(block);
+	}
+}
+
+struct image *ImageStore::push_back(const struct image &im)
+{
+	reserve(_size + 1);
+
+	struct image *slot = &(*this)[_size];
+	*slot = im;
+	_size++;
+
+	return slot;
+}
+
+void ImageStore::append(std::vector<struct image> *batch)
+{
+	reserve(_size + batch->size());
+
+	for (size_t i = 0; i < batch->size(); i++)
+	{
+		push_back(batch->at(i));
+	}
+}
+
+void ImageStore::clear()
+{
+	for (size_t i = 0; i < _blocks.size(); i++)
+	{
+		free(_blocks[i]);
+	}
+
+	_blocks.clear();
+	_size = 0;
+}
@@ -0,0 +1,62 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __slipnslide__ImageStore__
+#define __slipnslide__ImageStore__
+
+#include <vector>
+#include <crystfel/image.h>
+
+#define IMAGE_BLOCK_SHIFT 12
+#define IMAGE_BLOCK_SIZE (1 << IMAGE_BLOCK_SHIFT)
+
+/* Images held in fixed-size blocks which never move once allocated, so
+ * that struct image pointers (peak->parent, the panels' image lists) stay
+ * valid however many more images are added. */
+
+class ImageStore
+{
+public:
+	ImageStore();
+	~ImageStore();
+
+	size_t size()
+	{
+		return _size;
+	}
+
+	struct image &operator[](size_t i)
+	{
+		return _blocks[i >> IMAGE_BLOCK_SHIFT][i & (IMAGE_BLOCK_SIZE - 1)];
+	}
+
+	struct image *push_back(const struct image &im);
+	void append(std::vector<struct image> *batch);
+
+	/* allocates blocks for at least n images in total up front */
+	void reserve(size_t n);
+	void clear();
+private:
+	ImageStore(const ImageStore &other);
+	ImageStore &operator=(const ImageStore &other);
+
+	std::vector<struct image *> _blocks;
+	size_t _size;
+};
+
+#endif
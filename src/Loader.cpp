@@ -0,0 +1,69 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "Loader.h"
+#include "StreamLoader.h"
+
+Loader::Loader(std::string filename, struct detector *det)
+{
+	_success = false;
+	_loader = new StreamLoader(filename, det);
+	_loader->setBatchHandler(Loader::handleBatch, this);
+}
+
+Loader::~Loader()
+{
+	delete _loader;
+}
+
+void Loader::cancel()
+{
+	_loader->cancel();
+}
+
+size_t Loader::chunkCount()
+{
+	return _loader->chunkCount();
+}
+
+void Loader::handleBatch(void *object, std::vector<struct image> *batch)
+{
+	Loader *me = static_cast<Loader *>(object);
+
+	me->_mutex.lock();
+	me->_waiting.insert(me->_waiting.end(), batch->begin(), batch->end());
+	me->_mutex.unlock();
+
+	emit me->progress(me->_loader->chunksRead(), me->chunkCount());
+	emit me->batchReady();
+}
+
+void Loader::takeImages(Session *dest)
+{
+	_mutex.lock();
+	dest->addImages(&_waiting);
+	_waiting.clear();
+	_mutex.unlock();
+}
+
+void Loader::load()
+{
+	_success = _loader->load(NULL);
+
+	emit resultReady();
+}
@@ -0,0 +1,63 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __slipnslide__Loader__
+#define __slipnslide__Loader__
+
+#include <QObject>
+#include <mutex>
+#include <crystfel/detector.h>
+#include <crystfel/image.h>
+#include "Session.h"
+
+class StreamLoader;
+
+/* Runs a StreamLoader on a worker thread and passes batches of images
+ * back to the GUI thread, which collects them with takeImages(). */
+
+class Loader : public QObject
+{
+Q_OBJECT
+public:
+	Loader(std::string filename, struct detector *det);
+	~Loader();
+
+	void cancel();
+	size_t chunkCount();
+	void takeImages(Session *dest);
+	
+	bool succeeded()
+	{
+		return _success;
+	}
+signals:
+	void progress(int done, int total);
+	void batchReady();
+	void resultReady();
+public slots:
+	void load();
+private:
+	static void handleBatch(void *object, std::vector<struct image> *batch);
+
+	StreamLoader *_loader;
+	std::mutex _mutex;
+	std::vector<struct image> _waiting;
+	bool _success;
+};
+
+#endif
@@ -0,0 +1,735 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "MappedStream.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <crystfel/utils.h>
+#include <crystfel/events.h>
+#include <crystfel/reflist.h>
+#include <crystfel/cell.h>
+#include <crystfel/cell-utils.h>
+
+#define CHUNK_MARKER "----- Begin chunk -----"
+
+typedef struct
+{
+	const char *pos;
+	const char *end;
+} Cursor;
+
+/* line runs from *line up to but not including *eol */
+static bool next_line(Cursor *c, const char **line, const char **eol)
+{
+	if (c->pos >= c->end)
+	{
+		return false;
+	}
+
+	const char *nl = (const char *)memchr(c->pos, '\n', c->end - c->pos);
+	*line = c->pos;
+	*eol = (nl == NULL) ? c->end : nl;
+	c->pos = (nl == NULL) ? c->end : nl + 1;
+
+	if (*eol > *line && *(*eol - 1) == '\r')
+	{
+		(*eol)--;
+	}
+
+	return true;
+}
+
+static bool starts_with(const char *line, const char *eol, const char *prefix)
+{
+	size_t len = strlen(prefix);
+	if ((size_t)(eol - line) < len)
+	{
+		return false;
+	}
+
+	return (memcmp(line, prefix, len) == 0);
+}
+
+static void skip_space(const char **p, const char *eol)
+{
+	while (*p < eol && (**p == ' ' || **p == '\t'))
+	{
+		(*p)++;
+	}
+}
+
+static bool parse_word(const char **p, const char *eol,
+                       const char **word, size_t *len)
+{
+	skip_space(p, eol);
+	*word = *p;
+
+	while (*p < eol && **p != ' ' && **p != '\t')
+	{
+		(*p)++;
+	}
+
+	*len = *p - *word;
+	return (*len > 0);
+}
+
+static bool parse_int(const char **p, const char *eol, int *val)
+{
+	skip_space(p, eol);
+
+	bool neg = false;
+	if (*p < eol && (**p == '-' || **p == '+'))
+	{
+		neg = (**p == '-');
+		(*p)++;
+	}
+
+	const char *start = *p;
+	long v = 0;
+	while (*p < eol && **p >= '0' && **p <= '9')
+	{
+		v = v * 10 + (**p - '0');
+		(*p)++;
+	}
+
+	if (*p == start)
+	{
+		return false;
+	}
+
+	*val = neg ? -v : v;
+	return true;
+}
+
+static const double pow10_exact[] =
+{
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* decimal to double without a NUL-terminated copy. Up to 19 significant
+ * digits are kept, which is more than any stream carries. */
+static bool parse_double(const char **p, const char *eol, double *val)
+{
+	skip_space(p, eol);
+
+	bool neg = false;
+	if (*p < eol && (**p == '-' || **p == '+'))
+	{
+		neg = (**p == '-');
+		(*p)++;
+	}
+
+	if (eol - *p >= 3 && strncasecmp(*p, "nan", 3) == 0)
+	{
+		*p += 3;
+		*val = NAN;
+		return true;
+	}
+
+	if (eol - *p >= 3 && strncasecmp(*p, "inf", 3) == 0)
+	{
+		*p += 3;
+		*val = neg ? -INFINITY : INFINITY;
+		return true;
+	}
+
+	uint64_t mant = 0;
+	int digits = 0;
+	int exp10 = 0;
+	bool any = false;
+
+	while (*p < eol && **p >= '0' && **p <= '9')
+	{
+		if (digits < 19)
+		{
+			mant = mant * 10 + (**p - '0');
+			if (mant > 0) digits++;
+		}
+		else
+		{
+			exp10++;
+		}
+
+		any = true;
+		(*p)++;
+	}
+
+	if (*p < eol && **p == '.')
+	{
+		(*p)++;
+
+		while (*p < eol && **p >= '0' && **p <= '9')
+		{
+			if (digits < 19)
+			{
+				mant = mant * 10 + (**p - '0');
+				if (mant > 0) digits++;
+				exp10--;
+			}
+
+			any = true;
+			(*p)++;
+		}
+	}
+
+	if (!any)
+	{
+		return false;
+	}
+
+	if (*p < eol && (**p == 'e' || **p == 'E'))
+	{
+		const char *save = *p;
+		(*p)++;
+		int e = 0;
+
+		if (parse_int(p, eol, &e))
+		{
+			exp10 += e;
+		}
+		else
+		{
+			*p = save;
+		}
+	}
+
+	double v = (double)mant;
+	if (exp10 >= 0 && exp10 <= 22)
+	{
+		v *= pow10_exact[exp10];
+	}
+	else if (exp10 < 0 && exp10 >= -22)
+	{
+		v /= pow10_exact[-exp10];
+	}
+	else
+	{
+		v *= pow(10., exp10);
+	}
+
+	*val = neg ? -v : v;
+	return true;
+}
+
+/* panels tend to come in runs, so try the last one first */
+static struct panel *find_panel(struct detector *det, const char *name,
+                                size_t len, int *last)
+{
+	for (int i = 0; i < det->n_panels; i++)
+	{
+		int n = (*last + i) % det->n_panels;
+		const char *pname = det->panels[n].name;
+
+		if (strncmp(pname, name, len) == 0 && pname[len] == '\0')
+		{
+			*last = n;
+			return &det->panels[n];
+		}
+	}
+
+	return NULL;
+}
+
+MappedStream::MappedStream(std::string filename)
+{
+	_map = NULL;
+	_size = 0;
+	_major = 0;
+	_minor = 0;
+	_maxADU = +INFINITY;
+	_sym = NULL;
+
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+	{
+		return;
+	}
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	_map = (const char *)map;
+	_size = st.st_size;
+
+	readVersion();
+}
+
+MappedStream::~MappedStream()
+{
+	if (_map != NULL)
+	{
+		munmap((void *)_map, _size);
+	}
+}
+
+void MappedStream::readVersion()
+{
+	Cursor c = {_map, _map + _size};
+	const char *line, *eol;
+
+	if (!next_line(&c, &line, &eol))
+	{
+		return;
+	}
+
+	const char *magic = "CrystFEL stream format ";
+	if (!starts_with(line, eol, magic))
+	{
+		return;
+	}
+
+	const char *p = line + strlen(magic);
+	if (!parse_int(&p, eol, &_major) || p >= eol || *p != '.')
+	{
+		return;
+	}
+
+	p++;
+	parse_int(&p, eol, &_minor);
+}
+
+bool MappedStream::canParse()
+{
+	return (_map != NULL && (_major > 2 || (_major == 2 && _minor >= 3)));
+}
+
+void MappedStream::findChunks(std::vector<off_t> *offsets)
+{
+	const char *marker = CHUNK_MARKER;
+	size_t len = strlen(marker);
+	const char *pos = _map;
+	const char *end = _map + _size;
+
+	while (pos < end)
+	{
+		const char *hit = (const char *)memmem(pos, end - pos, marker, len);
+		if (hit == NULL)
+		{
+			break;
+		}
+
+		if (hit == _map || *(hit - 1) == '\n')
+		{
+			offsets->push_back(hit - _map);
+		}
+
+		pos = hit + len;
+	}
+}
+
+static bool read_peaks(Cursor *c, struct image *image, int *last)
+{
+	const char *line, *eol;
+
+	image->features = image_feature_list_new();
+
+	/* column headers */
+	if (!next_line(c, &line, &eol))
+	{
+		return false;
+	}
+
+	while (next_line(c, &line, &eol))
+	{
+		if (starts_with(line, eol, "End of peak list"))
+		{
+			return true;
+		}
+
+		const char *p = line;
+		double fs, ss, one_over_d, intensity;
+		const char *name;
+		size_t len;
+
+		if (!parse_double(&p, eol, &fs) || !parse_double(&p, eol, &ss) ||
+		    !parse_double(&p, eol, &one_over_d) ||
+		    !parse_double(&p, eol, &intensity) ||
+		    !parse_word(&p, eol, &name, &len))
+		{
+			ERROR("Couldn't understand peak line.\n");
+			return false;
+		}
+
+		struct panel *pn = find_panel(image->det, name, len, last);
+		if (pn == NULL)
+		{
+			ERROR("Unrecognised panel name in peak list.\n");
+			return false;
+		}
+
+		image_add_feature(image->features, fs - pn->orig_min_fs,
+		                  ss - pn->orig_min_ss, pn, image,
+		                  intensity, NULL);
+	}
+
+	return false;
+}
+
+/* reflections at or above max_adu are dropped here and the rest go straight
+ * in under their asymmetric indices, so each crystal's final list is the
+ * only one ever built */
+static RefList *read_reflections(Cursor *c, struct detector *det, int *last,
+                                 double max_adu, const SymOpList *sym)
+{
+	const char *line, *eol;
+	RefList *list = reflist_new();
+
+	/* column headers */
+	if (!next_line(c, &line, &eol))
+	{
+		return list;
+	}
+
+	while (next_line(c, &line, &eol))
+	{
+		if (starts_with(line, eol, "End of reflections"))
+		{
+			break;
+		}
+
+		const char *p = line;
+		int h, k, l;
+		double intensity, sigma, peak, bg, fs, ss;
+		const char *name;
+		size_t len;
+
+		if (!parse_int(&p, eol, &h) || !parse_int(&p, eol, &k) ||
+		    !parse_int(&p, eol, &l) ||
+		    !parse_double(&p, eol, &intensity) ||
+		    !parse_double(&p, eol, &sigma) ||
+		    !parse_double(&p, eol, &peak) || !parse_double(&p, eol, &bg) ||
+		    !parse_double(&p, eol, &fs) || !parse_double(&p, eol, &ss) ||
+		    !parse_word(&p, eol, &name, &len))
+		{
+			ERROR("Couldn't understand reflection line.\n");
+			continue;
+		}
+
+		if (!(peak < max_adu))
+		{
+			continue;
+		}
+
+		struct panel *pn = find_panel(det, name, len, last);
+		if (pn == NULL)
+		{
+			ERROR("Unrecognised panel name in reflection list.\n");
+			continue;
+		}
+
+		signed int ha = h, ka = k, la = l;
+		if (sym != NULL)
+		{
+			get_asymm(sym, h, k, l, &ha, &ka, &la);
+		}
+
+		Reflection *refl = add_refl(list, ha, ka, la);
+		set_symmetric_indices(refl, h, k, l);
+		set_intensity(refl, intensity);
+		set_esd_intensity(refl, sigma);
+		set_peak(refl, peak);
+		set_mean_bg(refl, bg);
+		set_detector_pos(refl, fs - pn->orig_min_fs, ss - pn->orig_min_ss);
+		set_panel(refl, pn);
+		set_redundancy(refl, 1);
+	}
+
+	return list;
+}
+
+static bool read_vector(const char *p, const char *eol,
+                        double *x, double *y, double *z)
+{
+	if (!parse_double(&p, eol, x) || !parse_double(&p, eol, y) ||
+	    !parse_double(&p, eol, z))
+	{
+		return false;
+	}
+
+	/* nm^-1 to m^-1 */
+	*x *= 1e9; *y *= 1e9; *z *= 1e9;
+	return true;
+}
+
+static Crystal *read_crystal(Cursor *c, struct image *image, int *last,
+                             double max_adu, const SymOpList *sym)
+{
+	const char *line, *eol;
+	Crystal *cr = crystal_new();
+	UnitCell *cell = cell_new();
+	double asx = 0, asy = 0, asz = 0;
+	double bsx = 0, bsy = 0, bsz = 0;
+	double csx = 0, csy = 0, csz = 0;
+	int have_cell = 0;
+	RefList *refls = NULL;
+
+	while (next_line(c, &line, &eol))
+	{
+		if (starts_with(line, eol, "--- End crystal"))
+		{
+			break;
+		}
+
+		if (starts_with(line, eol, "astar = "))
+		{
+			have_cell += read_vector(line + 8, eol, &asx, &asy, &asz);
+		}
+		else if (starts_with(line, eol, "bstar = "))
+		{
+			have_cell += read_vector(line + 8, eol, &bsx, &bsy, &bsz);
+		}
+		else if (starts_with(line, eol, "cstar = "))
+		{
+			have_cell += read_vector(line + 8, eol, &csx, &csy, &csz);
+		}
+		else if (starts_with(line, eol, "lattice_type = "))
+		{
+			std::string str(line + 15, eol);
+			cell_set_lattice_type(cell, lattice_from_str(str.c_str()));
+		}
+		else if (starts_with(line, eol, "centering = ") && eol > line + 12)
+		{
+			cell_set_centering(cell, line[12]);
+		}
+		else if (starts_with(line, eol, "unique_axis = ") && eol > line + 14)
+		{
+			cell_set_unique_axis(cell, line[14]);
+		}
+		else if (starts_with(line, eol, "profile_radius = "))
+		{
+			const char *p = line + 17;
+			double r;
+			if (parse_double(&p, eol, &r))
+			{
+				crystal_set_profile_radius(cr, r * 1e9);
+			}
+		}
+		else if (starts_with(line, eol, "predict_refine/det_shift x = "))
+		{
+			const char *p = line + 29;
+			double x, y;
+			if (parse_double(&p, eol, &x))
+			{
+				skip_space(&p, eol);
+				if (starts_with(p, eol, "y = "))
+				{
+					p += 4;
+					if (parse_double(&p, eol, &y))
+					{
+						crystal_set_det_shift(cr, x * 1e-3, y * 1e-3);
+					}
+				}
+			}
+		}
+		else if (starts_with(line, eol, "Reflections measured after indexing"))
+		{
+			refls = read_reflections(c, image->det, last, max_adu, sym);
+		}
+	}
+
+	if (have_cell != 3)
+	{
+		ERROR("Crystal in stream is missing its reciprocal cell.\n");
+		cell_free(cell);
+		crystal_free(cr);
+		if (refls != NULL)
+		{
+			reflist_free(refls);
+		}
+		return NULL;
+	}
+
+	cell_set_reciprocal(cell, asx, asy, asz, bsx, bsy, bsz, csx, csy, csz);
+	crystal_set_cell(cr, cell);
+	crystal_set_image(cr, image);
+
+	if (refls == NULL)
+	{
+		refls = reflist_new();
+	}
+
+	crystal_set_reflections(cr, refls);
+
+	return cr;
+}
+
+/* number after "key = ", with optional units following */
+static bool header_value(const char *line, const char *eol,
+                         const char *key, double *val, const char **units)
+{
+	if (!starts_with(line, eol, key))
+	{
+		return false;
+	}
+
+	const char *p = line + strlen(key);
+	if (!parse_double(&p, eol, val))
+	{
+		return false;
+	}
+
+	skip_space(&p, eol);
+	*units = p;
+
+	return true;
+}
+
+bool MappedStream::readChunk(off_t start, struct image *image)
+{
+	Cursor c = {_map + start, _map + _size};
+	const char *line, *eol;
+	int last = 0;
+	double val;
+	const char *units;
+	bool have_lambda = false;
+
+	image->lambda = -1.0;
+	image->features = NULL;
+	image->crystals = NULL;
+	image->n_crystals = 0;
+	image->event = NULL;
+	image->filename = NULL;
+
+	/* Begin chunk marker */
+	if (!next_line(&c, &line, &eol))
+	{
+		return false;
+	}
+
+	while (next_line(&c, &line, &eol))
+	{
+		if (starts_with(line, eol, "----- End chunk -----"))
+		{
+			if (!have_lambda)
+			{
+				ERROR("Chunk in stream has no wavelength.\n");
+				return false;
+			}
+
+			return true;
+		}
+
+		if (starts_with(line, eol, "Image filename: "))
+		{
+			image->filename = strndup(line + 16, eol - line - 16);
+		}
+		else if (starts_with(line, eol, "Event: "))
+		{
+			std::string str(line + 7, eol);
+			image->event = get_event_from_event_string(str.c_str());
+		}
+		else if (starts_with(line, eol, "Image serial number: "))
+		{
+			const char *p = line + 21;
+			parse_int(&p, eol, &image->serial);
+		}
+		else if (header_value(line, eol, "photon_energy_eV = ",
+		                      &val, &units))
+		{
+			image->lambda = ph_en_to_lambda(eV_to_J(val));
+			have_lambda = true;
+		}
+		else if (header_value(line, eol, "wavelength = ", &val, &units))
+		{
+			image->lambda = val * 1e-10;
+			have_lambda = true;
+		}
+		else if (header_value(line, eol, "beam_divergence = ",
+		                      &val, &units))
+		{
+			bool mrad = starts_with(units, eol, "mrad");
+			image->div = mrad ? val / 1e3 : val;
+		}
+		else if (header_value(line, eol, "beam_bandwidth = ",
+		                      &val, &units))
+		{
+			bool percent = starts_with(units, eol, "%");
+			image->bw = percent ? val / 100. : val;
+		}
+		else if (header_value(line, eol, "average_camera_length = ",
+		                      &val, &units))
+		{
+			image->avg_clen = val;
+		}
+		else if (header_value(line, eol, "peak_resolution = ",
+		                      &val, &units))
+		{
+			image->peak_resolution = val * 1e9;
+		}
+		else if (starts_with(line, eol, "Peaks from peak search"))
+		{
+			if (!read_peaks(&c, image, &last))
+			{
+				return false;
+			}
+		}
+		else if (starts_with(line, eol, "--- Begin crystal"))
+		{
+			Crystal *cr = read_crystal(&c, image, &last, _maxADU, _sym);
+			if (cr == NULL)
+			{
+				continue;
+			}
+
+			/* capacity is the next power of two, so only grow when
+			 * the count reaches one */
+			size_t n = image->n_crystals;
+			if ((n & (n - 1)) == 0)
+			{
+				size_t cap = (n == 0 ? 1 : n * 2);
+				Crystal **crystals;
+				crystals = (Crystal **)realloc(image->crystals,
+				                               cap * sizeof(Crystal *));
+				if (crystals == NULL)
+				{
+					ERROR("Failed to allocate memory for crystals.\n");
+					crystal_free(cr);
+					return false;
+				}
+
+				image->crystals = crystals;
+			}
+
+			image->crystals[image->n_crystals] = cr;
+			image->n_crystals++;
+		}
+	}
+
+	/* ran off the end of the file before the end of the chunk */
+	return false;
+}
@@ -0,0 +1,69 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __slipnslide__MappedStream__
+#define __slipnslide__MappedStream__
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <crystfel/image.h>
+#include <crystfel/symmetry.h>
+
+/* Memory-mapped, read-only view of a CrystFEL stream. Chunks are parsed
+ * straight from the mapped pages into struct image, Crystal and RefList
+ * without copying lines, so several threads may read different chunks of
+ * the same map at once. Only stream format 2.3 and later is understood
+ * (peaks and reflections must carry panel names). */
+
+class MappedStream
+{
+public:
+	MappedStream(std::string filename);
+	~MappedStream();
+
+	bool isMapped()
+	{
+		return _map != NULL;
+	}
+
+	/* true if chunks can be parsed here rather than by read_chunk */
+	bool canParse();
+
+	/* reflections with a peak of max_adu or more are skipped while
+	 * reading, and the rest are stored under asymmetric indices */
+	void setFilter(double max_adu, const SymOpList *sym)
+	{
+		_maxADU = max_adu;
+		_sym = sym;
+	}
+
+	void findChunks(std::vector<off_t> *offsets);
+	bool readChunk(off_t start, struct image *image);
+private:
+	void readVersion();
+
+	const char *_map;
+	size_t _size;
+	int _major;
+	int _minor;
+	double _maxADU;
+	const SymOpList *_sym;
+};
+
+#endif
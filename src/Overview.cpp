@@ -20,6 +20,8 @@
 #include "SlipPanel.h"
 #include "DetectorView.h"
 #include "Splattice.h"
+#include "Loader.h"
+#include "Predictor.h"
 #include <FileReader.h>
 #include <CurveView.h>
 #include <Dialogue.h>
@@ -34,8 +36,9 @@
 #include <QSlider>
 #include <QLabel>
 #include <QPushButton>
+#include <QStatusBar>
+#include <QThread>
 
-#include <gsl/gsl_linalg.h>
 #include <crystfel/stream.h>
 #include <crystfel/utils.h>
 #include <crystfel/symmetry.h>
@@ -70,6 +73,15 @@ Overview::Overview(QWidget *parent) : QMainWindow(parent)
 	_horizLabel = NULL;
 	_vertSlider = NULL;
 	_vertLabel = NULL;
+	_loader = NULL;
+	_loadThread = NULL;
+	_firstBatch = false;
+	_cancelled = false;
+	_lastDraw = 0;
+	_session = new Session();
+	SlipPanel::setPeakStore(_session->peaks());
+	SlipPanel::setReflectionStore(_session->reflections());
+	_predictor = NULL;
 
 	setWindowState(Qt::WindowFullScreen);
 	setWindowFlags(Qt::CustomizeWindowHint | Qt::FramelessWindowHint);
@@ -100,6 +112,8 @@ void Overview::makeMenu()
 	connect(act, &QAction::triggered, this, &Overview::loadGeometry);
 	act = structure->addAction(tr("Load stream file"));
 	connect(act, &QAction::triggered, this, &Overview::loadStreamFile);
+	act = structure->addAction(tr("Cancel stream loading"));
+	connect(act, &QAction::triggered, this, &Overview::cancelLoad);
 
 	QMenu *splattice = menuBar()->addMenu(tr("&Splattice"));
 
@@ -172,24 +186,16 @@ void Overview::loadStreamFile()
 	std::string streamstr = openDialogue(this, "Choose geometry file", 
 	                                   "CrystFEL geometry file (*.geom)");
 
-	Stream *stream = open_stream_for_read(streamstr.c_str());
-
-	if (stream == NULL)
-	{
-		QMessageBox msgBox;
-		msgBox.setText(tr("Loading stream file failed."));
-		msgBox.exec();
-		return;
-	}
-
-	loadStream(stream);
-	close_stream(stream);
+	loadStream(streamstr);
 }
 
 void Overview::loadDetector(struct detector *det)
 {
 	_detector = det;
 	_detView->setDetector(det);
+
+	delete _predictor;
+	_predictor = new Predictor(det);
 }
 
 void Overview::makeSlider(QSlider **handle, QWidget *prev)
@@ -323,7 +329,7 @@ void Overview::makeIntensitySlider(QWidget *prev)
 void Overview::makeImageSlider(QWidget *prev)
 {
 	makeSlider(&_imageSlider, prev);
-	_imageSlider->setMaximum(_images.size());
+	_imageSlider->setMaximum(_session->imageCount());
 	_imageSlider->setValue(20);
 	connect(_imageSlider, &QSlider::valueChanged, 
 	        this, &Overview::handleImageSlider);
@@ -475,119 +481,145 @@ void Overview::updateDistanceLabel(double mm)
 	_distanceLabel->setText(QString::fromStdString(str));
 }
 
-static RefList *apply_max_adu(RefList *list, double max_adu)
+void Overview::loadStream(std::string filename)
 {
-	RefList *nlist;
-	Reflection *refl;
-	RefListIterator *iter;
+	if (_loadThread && _loadThread->isRunning())
+	{
+		QMessageBox msgBox;
+		msgBox.setText(tr("Already loading a stream file."));
+		msgBox.exec();
+		return;
+	}
 
-	nlist = reflist_new();
-	if ( nlist == NULL ) return NULL;
+	/* the old images are freed below, from under the refinement */
+	if (_detView != NULL && _detView->isRefining())
+	{
+		QMessageBox msgBox;
+		msgBox.setText(tr("Wait for refinement to finish before "
+		                  "loading a stream file."));
+		msgBox.exec();
+		return;
+	}
 
-	for ( refl = first_refl(list, &iter);
-	      refl != NULL;
-	      refl = next_refl(refl, iter) )
+	if (!_loadThread)
 	{
-		if ( get_peak(refl) < max_adu ) {
-			signed int h, k, l;
-			get_indices(refl, &h, &k, &l);
-			Reflection *nrefl = add_refl(nlist, h, k, l);
-			copy_data(nrefl, refl);
-		}
+		_loadThread = new QThread();
 	}
-	reflist_free(list);
-	return nlist;
+
+	/* a new stream replaces the old one: drop every reference to the
+	 * old images before handing their memory back */
+	if (_detView != NULL)
+	{
+		_detView->clearPanelScratch();
+	}
+
+	_splattice->clear();
+	_session->clear();
+
+	_loader = new Loader(filename, _detector);
+	_loader->moveToThread(_loadThread);
+	_firstBatch = true;
+	_cancelled = false;
+	_lastDraw = 0;
+
+	connect(this, SIGNAL(startLoad()), _loader, SLOT(load()));
+	connect(_loader, SIGNAL(batchReady()), this, SLOT(receiveImages()));
+	connect(_loader, SIGNAL(progress(int, int)), 
+	        this, SLOT(loadProgress(int, int)));
+	connect(_loader, SIGNAL(resultReady()), this, SLOT(loadFinished()));
+	_loadThread->start();
+
+	std::string str = "Loading " + filename;
+	statusBar()->showMessage(QString::fromStdString(str));
+
+	emit startLoad();
 }
 
-void Overview::loadStream(Stream *stream)
+bool Overview::isLoading()
 {
-	struct image *next;
-	
-	_images.resize(_images.size() + 1);
-	next = &_images[_images.size() - 1];
-	next->det = _detector;
+	return (_loadThread != NULL && _loadThread->isRunning());
+}
 
-	int n_crystals = 0;
-	int n_crystals_seen = 0;
-	Crystal **crystals = NULL;
-	double max_adu = +INFINITY;
+void Overview::cancelLoad()
+{
+	if (_loader == NULL)
+	{
+		return;
+	}
 
-	char *sym_str = NULL;
-	SymOpList *sym;
+	_cancelled = true;
+	_loader->cancel();
+}
+
+void Overview::loadProgress(int done, int total)
+{
+	std::string str = "Loaded " + i_to_str(done) + " of " 
+	+ i_to_str(total) + " chunks";
+	statusBar()->showMessage(QString::fromStdString(str));
+}
+
+void Overview::receiveImages()
+{
+	if (_loader == NULL)
+	{
+		return;
+	}
 
-	if ( sym_str == NULL ) sym_str = strdup("1");
-	pointgroup_warning(sym_str);
-	sym = get_pointgroup(sym_str);
+	size_t first = _session->imageCount();
 
-	while (true)
+	if (_firstBatch)
 	{
-		if (read_chunk(stream, next) != 0 )
-		{
-			break;
-		}
-
-		struct image *cur = &_images[_images.size() - 1];
-		cur->spectrum = spectrum_generate_gaussian(cur->lambda, cur->bw);
-		RefList *as;
-
-		for (int i = 0; i<cur->n_crystals; i++)
-		{
-
-			Crystal *cr;
-			Crystal **crystals_new;
-			RefList *cr_refl;
-			struct image *image;
-
-			n_crystals_seen++;
-			
-			crystals_new = (Crystal **)realloc(crystals,
-			                      (n_crystals+1)*sizeof(Crystal *));
-			if ( crystals_new == NULL ) {
-				ERROR("Failed to allocate memory for crystal "
-				      "list.\n");
-				return;
-			}
-			crystals = crystals_new;
-			crystals[n_crystals] = cur->crystals[i];
-			cr = crystals[n_crystals];
-
-			image = (struct image *)malloc(sizeof(struct image));
-			if ( image == NULL ) {
-				ERROR("Failed to allocatea memory for image.\n");
-				return;
-			}
-
-			crystal_set_image(cr, image);
-			*image = *cur;
-			image->n_crystals = 1;
-			image->crystals = &crystals[n_crystals];
-
-
-			/* This is the raw list of reflections */
-			cr_refl = crystal_get_reflections(cr);
-
-			cr_refl = apply_max_adu(cr_refl, max_adu);
-
-			as = asymmetric_indices(cr_refl, sym);
-			crystal_set_reflections(cr, as);
-			crystal_set_user_flag(cr, 0);
-			reflist_free(cr_refl);
-
-			n_crystals++;
-		}
-
-		_images.resize(_images.size() + 1);
-		next = &_images[_images.size() - 1];
-		next->det = _detector;
-		next->div = NAN;
-		next->bw = NAN;
+		/* allocate for the whole stream in one go */
+		_session->reserve(first + _loader->chunkCount());
+		_firstBatch = false;
 	}
+
+	_loader->takeImages(_session);
 	
-	_images.pop_back();
+	if (_session->imageCount() == first)
+	{
+		return;
+	}
 
-	makeImageSlider(_distanceLabel);
+	repredictImages(false, first);
+	_imageSlider->setMaximum(_session->imageCount());
+
+	/* curves cover every image, so don't redraw for every batch */
+	if (time(NULL) > _lastDraw)
+	{
+		_lastDraw = time(NULL);
+		_detView->updatePowderPattern();
+		_detView->updateTargetPattern();
+	}
+}
+
+void Overview::loadFinished()
+{
+	disconnect(this, SIGNAL(startLoad()), nullptr, nullptr);
+	_loadThread->quit();
+	_loadThread->wait();
+	
+	receiveImages();
+	bool success = _loader->succeeded();
+	delete _loader;
+	_loader = NULL;
 
-	repredictImages(false);
+	if (!success && !_cancelled)
+	{
+		statusBar()->clearMessage();
+		QMessageBox msgBox;
+		msgBox.setText(tr("Loading stream file failed."));
+		msgBox.exec();
+	}
+	else
+	{
+		std::string str = (_cancelled ? "Loading cancelled with " :
+		                   "Finished loading ");
+		str += i_to_str(_session->imageCount()) + " images";
+		statusBar()->showMessage(QString::fromStdString(str));
+	}
+
+	makeImageSlider(_distanceLabel);
 
 	_detView->updatePowderPattern();
 	_detView->updateTargetPattern();
@@ -676,215 +708,38 @@ void Overview::refineButtons(QWidget *prev)
 	b->show();
 }
 
-static int locate_peak_on_panel(double x, double y, double z, double k,
-                                struct panel *p,
-                                double *pfs, double *pss)
-{
-	double ctt, tta, phi;
-	gsl_vector *v;
-	gsl_vector *t;
-	gsl_matrix *M;
-	double fs, ss, one_over_mu;
-
-	/* Calculate 2theta (scattering angle) and azimuth (phi) */
-	tta = atan2(sqrt(x*x+y*y), k+z);
-	ctt = cos(tta);
-	phi = atan2(y, x);
-
-	/* Set up matrix equation */
-	M = gsl_matrix_alloc(3, 3);
-	v = gsl_vector_alloc(3);
-	t = gsl_vector_alloc(3);
-	if ( (M==NULL) || (v==NULL) || (t==NULL) ) {
-		ERROR("Failed to allocate vectors for prediction\n");
-		return 0;
-	}
-
-	gsl_vector_set(t, 0, sin(tta)*cos(phi));
-	gsl_vector_set(t, 1, sin(tta)*sin(phi));
-	gsl_vector_set(t, 2, ctt);
-
-	gsl_matrix_set(M, 0, 0, p->cnx);
-	gsl_matrix_set(M, 0, 1, p->fsx);
-	gsl_matrix_set(M, 0, 2, p->ssx);
-	gsl_matrix_set(M, 1, 0, p->cny);
-	gsl_matrix_set(M, 1, 1, p->fsy);
-	gsl_matrix_set(M, 1, 2, p->ssy);
-	gsl_matrix_set(M, 2, 0, p->clen*p->res);
-	gsl_matrix_set(M, 2, 1, p->fsz);
-	gsl_matrix_set(M, 2, 2, p->ssz);
-
-	if ( gsl_linalg_HH_solve(M, t, v) ) {
-		ERROR("Failed to solve prediction equation\n");
-		return 0;
-	}
-
-	one_over_mu = gsl_vector_get(v, 0);
-	fs = gsl_vector_get(v, 1) / one_over_mu;
-	ss = gsl_vector_get(v, 2) / one_over_mu;
-	gsl_vector_free(v);
-	gsl_vector_free(t);
-	gsl_matrix_free(M);
-
-	*pfs = fs;  *pss = ss;
-
-	/* Now, is this on this panel? */
-	if ( fs < 0.0 ) return 0;
-	if ( fs >= p->w ) return 0;
-	if ( ss < 0.0 ) return 0;
-	if ( ss >= p->h ) return 0;
-
-	return 1;
-}
-
-static signed int locate_peak(double x, double y, double z, double k,
-                              struct detector *det, double *pfs, double *pss)
-{
-	int i;
-
-	*pfs = -1;  *pss = -1;
-
-	for ( i=0; i<det->n_panels; i++ ) {
-
-		struct panel *p;
-
-		p = &det->panels[i];
-
-		if ( locate_peak_on_panel(x, y, z, k, p, pfs, pss) ) {
-
-			/* Woohoo! */
-			return i;
-
-		}
-
-	}
-
-	return -1;
-}
-
 void Overview::recalculateImages()
 {
 	repredictImages(true);
 }
 
-void Overview::repredictImages(bool recalc)
+void Overview::repredictImages(bool recalc, size_t start)
 {
-	struct detector *det = _detView->getDetector();
-
-	double asx, asy, asz;
-	double bsx, bsy, bsz;
-	double csx, csy, csz;
-
-	for (size_t i = 0; i < _images.size(); i++)
+	_predictor->repredict(_session, start, recalc);
+	
+	if (start == 0)
 	{
-		struct image *im = &_images.at(i);
-		im->det = det;
-		double knom = 1.0/im->lambda;
-
-		ImageFeatureList *list = im->features;
-		for (int j = 0; j < image_feature_count(list); j++)
-		{
-			struct imagefeature *peak;
-			peak = image_get_feature(list, j);
-			peak->parent = im;
-			
-			double fs = peak->fs;
-			double ss = peak->ss;
-
-			if (recalc)
-			{
-				signed int pnum = locate_peak(peak->rx, peak->ry, peak->rz, 
-				                              knom, det, &fs, &ss);
-				
-//				peak->fs = fs;
-//				peak->ss = ss;
-				peak->p = &det->panels[0];
-
-				if (pnum >= 0)
-				{
-					peak->p = &det->panels[pnum];
-				}
-			}
-
-			struct panel *p = peak->p;
-			
-			double x = (p->cnx  + fs*p->fsx + ss*p->ssx);
-			x /= p->res;
-			double y = (p->cny  + fs*p->fsy + ss*p->ssy);
-			y /= p->res;
-			double z = (fs*p->fsz + ss*p->ssz);
-			z /= p->res;
-			z += (p->clen + p->coffset);
-
-			vec3 v = make_vec3(x, y, z);
-
-			vec3_set_length(&v, knom);
-
-			peak->rx = v.x;
-			peak->ry = v.y;
-			peak->rz = v.z - knom;
-		}
-
-		for (int j = 0; j < im->n_crystals; j++)
-		{
-			Crystal *cryst = im->crystals[j];
-			RefListIterator *it;
-			RefList *refs = crystal_get_reflections(cryst);
-			Reflection *ref = first_refl(refs, &it);
-			UnitCell *cell = crystal_get_cell(cryst);
-
-			cell_get_reciprocal(cell, &asx, &asy, &asz,
-			                    &bsx, &bsy, &bsz,
-			                    &csx, &csy, &csz);
-
-			while (true)
-			{
-				ref = (next_refl(ref, it));
-				if (ref == NULL)
-				{
-					break;
-				}
-
-				signed int h, k, l;
-				get_symmetric_indices(ref, &h, &k, &l);
-
-				double xl = h*asx + k*bsx + l*csx;
-				double yl = h*asy + k*bsy + l*csy;
-				double zl = h*asz + k*bsz + l*csz;
-
-				double fs, ss;        /* Position on detector */
-				signed int p;         /* Panel number */
-				p = locate_peak(xl, yl, zl, knom,
-				                det, &fs, &ss);
-				if (p < 0)
-				{
-					p = 0;
-				}
-
-				set_detector_pos(ref, fs, ss);
-				set_panel(ref, &det->panels[p]);
-			}
-		}
+		supplyAllImages();
+	}
+	else
+	{
+		supplyImages(start);
 	}
-	
-	supplyAllImages();
 }
 
 void Overview::supplyAllImages()
 {
 	_detView->clearPanelScratch();
+	supplyImages(0);
+}
 
-	for (size_t i = 0; i < _images.size(); i++)
-	{
-		struct image *ptr = &_images[i];
-		_detView->imageToPanels(ptr);
-	}
+void Overview::supplyImages(size_t start)
+{
+	/* from the start, peaks may have been moved to other panels */
+	_session->peaks()->update(_session, start == 0);
+	_detView->imagesToPanels(_session->imageCount());
 
-	for (size_t i = 0; i < _images.size(); i++)
-	{
-		struct image *ptr = &_images[i];
-		_splattice->addImage(ptr);
-	}
+	_splattice->addImages(_session, start);
 }
 
 void Overview::supplyImagesToPanel(SlipPanel *p)
@@ -892,11 +747,13 @@ void Overview::supplyImagesToPanel(SlipPanel *p)
 	p->clearImageData();
 	p->setMaxImages(_imageSlider->value());
 
-	for (size_t i = 0; i < _images.size(); i++)
-	{
-		struct image *ptr = &_images[i];
-		p->getPeaksFromImage(ptr);
-	}
+	topUpPanel(p);
+}
+
+/* only images the panel hasn't seen yet, keeping the pairs it holds */
+void Overview::topUpPanel(SlipPanel *p)
+{
+	p->addImages(_session->imageCount());
 	
 	_detView->updatePowderPattern();
 	_detView->updateTargetPattern();
@@ -23,8 +23,12 @@
 #include <crystfel/detector.h>
 #include <crystfel/stream.h>
 #include <crystfel/image.h>
+#include "Session.h"
 
 class Splattice;
+class Loader;
+class Predictor;
+class QThread;
 class QSlider;
 class QLabel;
 class DetectorView;
@@ -39,18 +43,26 @@ public:
 	Overview(QWidget *parent = NULL);
 	
 	void loadDetector(struct detector *det);
-	void loadStream(Stream *stream);
+	void loadStream(std::string filename);
 	void updateDistanceLabel(double mm);
 	void supplyAllImages();
+	void supplyImages(size_t start);
 	void supplyImagesToPanel(SlipPanel *p);
+	void topUpPanel(SlipPanel *p);
 	void resetSliders();
 
 	QWidget *splitButton(QWidget *prev);
 	
-	std::vector<struct image> *images()
+	Session *session()
 	{
-		return &_images;
+		return _session;
 	}
+
+	/* while true, each batch which arrives is repredicted and put
+	 * into the session's stores on the GUI thread */
+	bool isLoading();
+signals:
+	void startLoad();
 public slots:
 	void handleImageSlider(int tick);
 	void handleIntensitySlider(int tick);
@@ -63,6 +75,10 @@ public slots:
 	void recalculateImages();
 
 	void loadStreamFile();
+	void cancelLoad();
+	void receiveImages();
+	void loadProgress(int done, int total);
+	void loadFinished();
 	void loadGeometry();
 	void writeGeometry();
 
@@ -84,17 +100,23 @@ private:
 	void makeSlider(QSlider **handle, QWidget *prev);
 	void makeSliderLabel(QLabel **label, QWidget *prev);
 	void refineButtons(QWidget *prev);
-	void repredictImages(bool recalc = true);
+	void repredictImages(bool recalc = true, size_t start = 0);
 
 	double targetScore();
 
-	std::vector<struct image> _images;
+	Session *_session;
 	CurveView *_powderView;
 	CurveView *_targetView;
 	DetectorView *_detView;
 	struct detector *_detector;
 	std::string _geomstr;
 	Splattice *_splattice;
+	Loader *_loader;
+	Predictor *_predictor;
+	QThread *_loadThread;
+	bool _firstBatch;
+	bool _cancelled;
+	time_t _lastDraw;
 
 	QSlider *_distanceSlider;
 	QSlider *_imageSlider;
@@ -0,0 +1,204 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "PanelTransform.h"
+#include "predict_kernel.h"
+#include <math.h>
+
+PanelTransform::PanelTransform(struct detector *det)
+{
+	_det = det;
+	update();
+}
+
+void panel_key(struct panel *p, double *key)
+{
+	key[0] = p->cnx;
+	key[1] = p->cny;
+	key[2] = p->clen;
+	key[3] = p->res;
+	key[4] = p->fsx;
+	key[5] = p->fsy;
+	key[6] = p->fsz;
+	key[7] = p->ssx;
+	key[8] = p->ssy;
+	key[9] = p->ssz;
+	key[10] = p->coffset;
+	key[11] = p->w;
+	key[12] = p->h;
+}
+
+/* closed form, with the corner and the two pixel axes as columns */
+bool panel_inverse(struct panel *p, double *inv)
+{
+	double a = p->cnx, b = p->fsx, c = p->ssx;
+	double d = p->cny, e = p->fsy, f = p->ssy;
+	double g = p->clen * p->res, h = p->fsz, i = p->ssz;
+
+	double A = e*i - f*h;
+	double B = f*g - d*i;
+	double C = d*h - e*g;
+	double det = a*A + b*B + c*C;
+
+	if (det == 0 || !isfinite(det))
+	{
+		return false;
+	}
+
+	double r = 1 / det;
+	inv[0] = A * r;
+	inv[1] = (c*h - b*i) * r;
+	inv[2] = (b*f - c*e) * r;
+	inv[3] = B * r;
+	inv[4] = (a*i - c*g) * r;
+	inv[5] = (c*d - a*f) * r;
+	inv[6] = C * r;
+	inv[7] = (b*g - a*h) * r;
+	inv[8] = (a*e - b*d) * r;
+
+	return true;
+}
+
+void PanelTransform::update()
+{
+	_coeffs.resize(_det->n_panels * PANEL_COEFFS);
+	_inverses.resize(_det->n_panels * 9);
+	_solvable.resize(_det->n_panels);
+
+	for (int i = 0; i < _det->n_panels; i++)
+	{
+		struct panel *p = &_det->panels[i];
+		double *c = &_coeffs[i * PANEL_COEFFS];
+
+		/* 3D position of a pixel, in m */
+		c[0] = p->fsx / p->res;
+		c[1] = p->ssx / p->res;
+		c[2] = p->cnx / p->res;
+		c[3] = p->fsy / p->res;
+		c[4] = p->ssy / p->res;
+		c[5] = p->cny / p->res;
+		c[6] = p->fsz / p->res;
+		c[7] = p->ssz / p->res;
+		c[8] = p->clen + p->coffset;
+
+		_solvable[i] = panel_inverse(p, &_inverses[i * 9]);
+	}
+}
+
+void PanelTransform::clear(PixelBatch *batch)
+{
+	batch->peaks.clear();
+	batch->panels.clear();
+	batch->fs.clear();
+	batch->ss.clear();
+	batch->k.clear();
+}
+
+void PanelTransform::transform(PixelBatch *batch)
+{
+	size_t n = batch->peaks.size();
+	batch->rx.resize(n);
+	batch->ry.resize(n);
+	batch->rz.resize(n);
+
+	transform(batch->panels.data(), batch->fs.data(), batch->ss.data(),
+	          batch->k.data(), n, batch->rx.data(), batch->ry.data(),
+	          batch->rz.data());
+
+	for (size_t i = 0; i < n; i++)
+	{
+		struct imagefeature *peak = batch->peaks[i];
+		peak->rx = batch->rx[i];
+		peak->ry = batch->ry[i];
+		peak->rz = batch->rz[i];
+	}
+
+	clear(batch);
+}
+
+void PanelTransform::transform(const int *panels, const double *fs,
+                               const double *ss, const double *k, size_t n,
+                               double *rx, double *ry, double *rz)
+{
+	pixels_to_reciprocal(_coeffs.data(), panels, fs, ss, k, n, rx, ry, rz);
+}
+
+void PanelTransform::clear(ReflectionBatch *batch)
+{
+	batch->rows.clear();
+	batch->panels.clear();
+	batch->x.clear();
+	batch->y.clear();
+	batch->z.clear();
+	batch->k.clear();
+}
+
+void PanelTransform::project(ReflectionBatch *batch, const RefColumns *cols)
+{
+	size_t n = batch->rows.size();
+	batch->fs.resize(n);
+	batch->ss.resize(n);
+
+	project(batch->panels.data(), batch->x.data(), batch->y.data(),
+	        batch->z.data(), batch->k.data(), n, batch->fs.data(),
+	        batch->ss.data());
+
+	for (size_t i = 0; i < n; i++)
+	{
+		if (!_solvable[batch->panels[i]])
+		{
+			batch->fs[i] = cols->fs[batch->rows[i]];
+			batch->ss[i] = cols->ss[batch->rows[i]];
+		}
+	}
+
+	clear(batch);
+}
+
+/* The ray is along (x, y, k + z); its length cancels in fs and ss. */
+void PanelTransform::project(const int *panels, const double *x,
+                             const double *y, const double *z,
+                             const double *k, size_t n,
+                             double *fs, double *ss)
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		int p = panels[i];
+
+		if (!_solvable[p])
+		{
+			fs[i] = NAN;
+			ss[i] = NAN;
+			continue;
+		}
+
+		const double *m = &_inverses[p * 9];
+		double t0 = x[i];
+		double t1 = y[i];
+		double t2 = k[i] + z[i];
+
+		if (t0 == 0 && t1 == 0 && t2 == 0)
+		{
+			t2 = 1;
+		}
+
+		double one_over_mu = m[0]*t0 + m[1]*t1 + m[2]*t2;
+		fs[i] = (m[3]*t0 + m[4]*t1 + m[5]*t2) / one_over_mu;
+		ss[i] = (m[6]*t0 + m[7]*t1 + m[8]*t2) / one_over_mu;
+	}
+}
@@ -0,0 +1,137 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __slipnslide__PanelTransform__
+#define __slipnslide__PanelTransform__
+
+#include <vector>
+#include <crystfel/detector.h>
+#include <crystfel/image.h>
+#include "ReflectionStore.h"
+
+/* peaks waiting to go through PanelTransform::transform(), as columns */
+typedef struct
+{
+	std::vector<struct imagefeature *> peaks;
+	std::vector<int> panels;
+	std::vector<double> fs, ss, k;
+	std::vector<double> rx, ry, rz;
+} PixelBatch;
+
+/* reflections waiting to go through PanelTransform::project(), with
+ * their reciprocal positions and beam wavenumber in matching units, and
+ * where they land once it has */
+typedef struct
+{
+	std::vector<size_t> rows;
+	std::vector<int> panels;
+	std::vector<double> x, y, z, k;
+	std::vector<double> fs, ss;
+} ReflectionBatch;
+
+/* corner, axes and resolution go into the inverse; offset and size
+ * only into whether the panel has moved */
+#define PANEL_KEY_SIZE 13
+
+/* the panel parameters above, in a fixed order, to compare against a
+ * copy taken earlier and so spot a panel which has moved since */
+void panel_key(struct panel *p, double *key);
+
+/* inverse of the matrix which takes (1/mu, fs, ss) to the direction of
+ * a ray hitting the panel, or false if it can't be inverted */
+bool panel_inverse(struct panel *p, double *inv);
+
+/* Takes peaks from pixel positions on their panels to reciprocal space,
+ * by way of the lab frame and the Ewald sphere of radius k, and takes
+ * reflections the other way, onto the panel each already belongs to.
+ * The affine map from (fs, ss) to the lab frame and the inverse used
+ * for projection are worked out once per panel by update(), which must
+ * be called again whenever a panel moves; peaks and reflections are
+ * then queued up with add() and converted together. */
+
+class PanelTransform
+{
+public:
+	PanelTransform(struct detector *det);
+
+	struct detector *detector()
+	{
+		return _det;
+	}
+
+	void update();
+
+	static void clear(PixelBatch *batch);
+
+	/* k in the units rx, ry, rz should come out in */
+	void add(PixelBatch *batch, struct imagefeature *peak,
+	         double fs, double ss, double k)
+	{
+		batch->peaks.push_back(peak);
+		batch->panels.push_back(peak->p - _det->panels);
+		batch->fs.push_back(fs);
+		batch->ss.push_back(ss);
+		batch->k.push_back(k);
+	}
+
+	void add(PixelBatch *batch, struct imagefeature *peak, double k)
+	{
+		add(batch, peak, peak->fs, peak->ss, k);
+	}
+
+	/* fills in rx, ry, rz of every queued peak, then empties the batch */
+	void transform(PixelBatch *batch);
+
+	/* the same for peaks already held as columns */
+	void transform(const int *panels, const double *fs, const double *ss,
+	               const double *k, size_t n,
+	               double *rx, double *ry, double *rz);
+
+	static void clear(ReflectionBatch *batch);
+
+	/* row is the reflection's row in the store */
+	void add(ReflectionBatch *batch, size_t row, int panel,
+	         double x, double y, double z, double k)
+	{
+		batch->rows.push_back(row);
+		batch->panels.push_back(panel);
+		batch->x.push_back(x);
+		batch->y.push_back(y);
+		batch->z.push_back(z);
+		batch->k.push_back(k);
+	}
+
+	/* puts the predicted position of every queued reflection in the
+	 * batch's fs and ss, in the order queued, then empties the rest of
+	 * the batch. The store is left alone; its last prediction is used
+	 * where the panel has no inverse. */
+	void project(ReflectionBatch *batch, const RefColumns *cols);
+
+	/* fs, ss of reciprocal positions on the plane of each given panel,
+	 * inside it or not; NAN where the panel has no inverse */
+	void project(const int *panels, const double *x, const double *y,
+	             const double *z, const double *k, size_t n,
+	             double *fs, double *ss);
+private:
+	struct detector *_det;
+	std::vector<double> _coeffs;
+	std::vector<double> _inverses;
+	std::vector<char> _solvable;
+};
+
+#endif
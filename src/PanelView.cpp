@@ -0,0 +1,97 @@
+// Slip n Slide
+// Copyright (C) 2019 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "PanelView.h"
+#include "SlipPanel.h"
+#include "shaders/vari_z.h"
+#include <string.h>
+
+#define DESELECTED_COLOUR (0.5)
+#define SELECTED_COLOUR (1.0)
+
+using namespace Helen3D;
+
+PanelView::PanelView(SlipPanel *panel) : SlipObject()
+{
+	_panel = panel;
+	createVertices();
+
+	_vString = variable_z_vsh();
+	_fString = variable_z_fsh();
+
+	_panel->setChangeHandler(PanelView::handleChange, this);
+}
+
+PanelView::~PanelView()
+{
+	_panel->setChangeHandler(NULL, NULL);
+}
+
+void PanelView::createVertices()
+{
+	_vertices.clear();
+	_indices.clear();
+	
+	_indices.push_back(0);
+	_indices.push_back(1);
+	_indices.push_back(2);
+	_indices.push_back(2);
+	_indices.push_back(1);
+	_indices.push_back(3);
+	
+	Vertex v;
+	memset(v.pos, 0, sizeof(Vertex));
+
+	v.color[0] = DESELECTED_COLOUR;
+	v.color[3] = 1;
+	_vertices.push_back(v);
+	_vertices.push_back(v);
+	_vertices.push_back(v);
+	_vertices.push_back(v);
+
+	updateVertices();
+}
+
+void PanelView::updateVertices()
+{
+	vec3 corner = _panel->corner();
+	vec3 fs = _panel->fastAxis();
+	vec3 ss = _panel->slowAxis();
+
+	lockMutex();
+	pos_from_vec(_vertices[0].pos, corner);
+	vec3 fcorn = fs;
+	vec3_mult(&fcorn, _panel->width());
+	vec3_add_to_vec3(&fcorn, corner);
+	pos_from_vec(_vertices[1].pos, fcorn);
+
+	vec3 scorn = ss;
+	vec3_mult(&scorn, _panel->height());
+	vec3_add_to_vec3(&scorn, corner);
+	pos_from_vec(_vertices[2].pos, scorn);
+
+	fcorn = fs;
+	vec3_mult(&fcorn, _panel->width());
+	vec3_add_to_vec3(&scorn, fcorn);
+	pos_from_vec(_vertices[3].pos, scorn);
+	unlockMutex();
+
+	double colour = (_panel->isHighlighted() ? SELECTED_COLOUR :
+	                 DESELECTED_COLOUR);
+	recolour(colour, 0, 0);
+}
@@ -0,0 +1,52 @@
+// Slip n Slide
+// Copyright (C) 2019 Helen Ginn
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+// 
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __slipnslide__PanelView__
+#define __slipnslide__PanelView__
+
+#include "SlipObject.h"
+
+class SlipPanel;
+
+/* Draws a single SlipPanel as a quad, following it as it moves and
+ * colouring it when it belongs to the selected group. */
+
+class PanelView : public SlipObject
+{
+public:
+	PanelView(SlipPanel *panel);
+	~PanelView();
+
+	SlipPanel *panel()
+	{
+		return _panel;
+	}
+
+	static void handleChange(void *object)
+	{
+		static_cast<PanelView *>(object)->updateVertices();
+	}
+
+	void updateVertices();
+private:
+	void createVertices();
+
+	SlipPanel *_panel;
+};
+
+#endif
@@ -0,0 +1,164 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "PeakStore.h"
+#include "Session.h"
+#include <algorithm>
+
+PeakStore::PeakStore()
+{
+	_det = NULL;
+	_panelStarts.assign(1, 0);
+	_generation = 0;
+}
+
+static void resize_columns(PeakColumns *c, size_t n)
+{
+	c->fs.resize(n);
+	c->ss.resize(n);
+	c->intensity.resize(n);
+	c->k.resize(n);
+	c->rx.resize(n);
+	c->ry.resize(n);
+	c->rz.resize(n);
+	c->panel.resize(n);
+	c->image.resize(n);
+}
+
+static void copy_rows(PeakColumns *from, size_t src, PeakColumns *to,
+                      size_t dest, size_t n)
+{
+	std::copy_n(from->fs.data() + src, n, to->fs.data() + dest);
+	std::copy_n(from->ss.data() + src, n, to->ss.data() + dest);
+	std::copy_n(from->intensity.data() + src, n, to->intensity.data() + dest);
+	std::copy_n(from->k.data() + src, n, to->k.data() + dest);
+	std::copy_n(from->rx.data() + src, n, to->rx.data() + dest);
+	std::copy_n(from->ry.data() + src, n, to->ry.data() + dest);
+	std::copy_n(from->rz.data() + src, n, to->rz.data() + dest);
+	std::copy_n(from->panel.data() + src, n, to->panel.data() + dest);
+	std::copy_n(from->image.data() + src, n, to->image.data() + dest);
+}
+
+void PeakStore::clear()
+{
+	_det = NULL;
+	std::vector<struct image *>().swap(_images);
+	_panelStarts.assign(1, 0);
+	_cols = PeakColumns();
+	_generation++;
+}
+
+/* New images come after every image already in, so each panel's rows
+ * stay in image order if the new ones go on the end of its range. */
+void PeakStore::update(Session *session, bool reassign)
+{
+	if (reassign)
+	{
+		clear();
+	}
+
+	size_t first = _images.size();
+	if (first >= session->imageCount())
+	{
+		return;
+	}
+
+	if (_det == NULL)
+	{
+		_det = session->image(first)->det;
+		_panelStarts.assign(_det->n_panels + 1, 0);
+	}
+
+	int np = panelCount();
+	std::vector<size_t> counts(np, 0);
+
+	for (size_t i = first; i < session->imageCount(); i++)
+	{
+		struct image *im = session->image(i);
+		ImageFeatureList *list = im->features;
+		_images.push_back(im);
+
+		for (int j = 0; j < image_feature_count(list); j++)
+		{
+			struct imagefeature *f = image_get_feature(list, j);
+			if (f->p != NULL)
+			{
+				counts[panelIndex(f->p)]++;
+			}
+		}
+	}
+
+	std::vector<size_t> starts(np + 1, 0);
+	std::vector<size_t> fill(np);
+	for (int p = 0; p < np; p++)
+	{
+		size_t old = _panelStarts[p + 1] - _panelStarts[p];
+		fill[p] = starts[p] + old;
+		starts[p + 1] = fill[p] + counts[p];
+	}
+
+	PeakColumns cols;
+	resize_columns(&cols, starts[np]);
+
+	for (int p = 0; p < np; p++)
+	{
+		copy_rows(&_cols, _panelStarts[p], &cols, starts[p],
+		          _panelStarts[p + 1] - _panelStarts[p]);
+	}
+
+	for (size_t i = first; i < _images.size(); i++)
+	{
+		struct image *im = _images[i];
+		ImageFeatureList *list = im->features;
+		double k = 1e-10 / im->lambda; /* inverse Angs */
+
+		for (int j = 0; j < image_feature_count(list); j++)
+		{
+			struct imagefeature *f = image_get_feature(list, j);
+			if (f->p == NULL)
+			{
+				continue;
+			}
+
+			int p = panelIndex(f->p);
+			size_t row = fill[p]++;
+			cols.fs[row] = f->fs;
+			cols.ss[row] = f->ss;
+			cols.intensity[row] = f->intensity;
+			cols.k[row] = k;
+			cols.rx[row] = f->rx;
+			cols.ry[row] = f->ry;
+			cols.rz[row] = f->rz;
+			cols.panel[row] = p;
+			cols.image[row] = i;
+		}
+	}
+
+	std::swap(_cols, cols);
+	_panelStarts.swap(starts);
+	_generation++;
+}
+
+size_t PeakStore::imageStart(int p, size_t image)
+{
+	const int *rows = _cols.image.data();
+	const int *start = rows + _panelStarts[p];
+	const int *end = rows + _panelStarts[p + 1];
+
+	return std::lower_bound(start, end, (int)image) - rows;
+}
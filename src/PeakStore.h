@@ -0,0 +1,111 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __slipnslide__PeakStore__
+#define __slipnslide__PeakStore__
+
+#include <vector>
+#include <crystfel/detector.h>
+#include <crystfel/image.h>
+
+class Session;
+
+/* one column per field of the peaks, all in the same row order */
+typedef struct
+{
+	std::vector<double> fs, ss;
+	std::vector<double> intensity;
+	std::vector<double> k;          /* 1 / wavelength, inverse Angs */
+	std::vector<double> rx, ry, rz; /* inverse Angs */
+	std::vector<int> panel;
+	std::vector<int> image;
+} PeakColumns;
+
+/* Every peak of every image in a session which lies on a panel, held once
+ * as columns and sorted by panel, then by image. Rows of panel p run from
+ * panelStart(p) to panelStart(p + 1), so a group of panels only needs the
+ * ranges of its members rather than its own copy of the peaks. Reciprocal
+ * positions here are the store's own, for whoever last moved the panel,
+ * and are not written back to the images. */
+
+class PeakStore
+{
+public:
+	PeakStore();
+
+	/* brings in images added to the session since last time; with
+	 * reassign set, starts again, as peaks may have changed panel */
+	void update(Session *session, bool reassign);
+	void clear();
+
+	size_t imageCount()
+	{
+		return _images.size();
+	}
+
+	struct image *image(size_t i)
+	{
+		return _images[i];
+	}
+
+	struct detector *detector()
+	{
+		return _det;
+	}
+
+	int panelCount()
+	{
+		return _panelStarts.size() - 1;
+	}
+
+	int panelIndex(struct panel *p)
+	{
+		return p - _det->panels;
+	}
+
+	size_t panelStart(int p)
+	{
+		return _panelStarts[p];
+	}
+
+	/* first row of panel p from the given image onwards */
+	size_t imageStart(int p, size_t image);
+
+	PeakColumns *columns()
+	{
+		return &_cols;
+	}
+
+	/* changes whenever rows move, so that anyone holding on to rows
+	 * can tell they no longer point at the same peaks */
+	unsigned long generation()
+	{
+		return _generation;
+	}
+private:
+	PeakStore(const PeakStore &other);
+	PeakStore &operator=(const PeakStore &other);
+
+	struct detector *_det;
+	std::vector<struct image *> _images;
+	std::vector<size_t> _panelStarts;
+	PeakColumns _cols;
+	unsigned long _generation;
+};
+
+#endif
@@ -0,0 +1,589 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "Predictor.h"
+#include "Session.h"
+#include "thread_utils.h"
+#include "predict_kernel.h"
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <crystfel/utils.h>
+
+/* cells per side of the panel index, per square root of panel count */
+#define INDEX_DENSITY 2
+#define INDEX_MAX_CELLS 512
+
+/* images per job when repredicting across threads */
+#define IMAGES_PER_JOB 64
+
+Predictor::Predictor(struct detector *det) : _transform(det)
+{
+	_det = det;
+	_threads = thread_count();
+	_firstDirty = 0;
+	_lastSession = NULL;
+	_lastGeneration = 0;
+	_u0 = 0;
+	_v0 = 0;
+	_du = 1;
+	_dv = 1;
+	_nu = 0;
+	_nv = 0;
+}
+
+void Predictor::updatePanels()
+{
+	bool changed = false;
+
+	if (_inverses.size() != (size_t)_det->n_panels)
+	{
+		changed = true;
+		_inverses.resize(_det->n_panels);
+		_versions.assign(_det->n_panels, 0);
+		_doneVersions.clear();
+
+		for (size_t i = 0; i < _inverses.size(); i++)
+		{
+			_inverses[i].valid = false;
+			_inverses[i].key[0] = NAN;
+		}
+	}
+
+	for (int i = 0; i < _det->n_panels; i++)
+	{
+		PanelInverse *pi = &_inverses[i];
+		double key[PANEL_KEY_SIZE];
+		panel_key(&_det->panels[i], key);
+
+		if (memcmp(key, pi->key, sizeof(key)) == 0)
+		{
+			continue;
+		}
+
+		memcpy(pi->key, key, sizeof(key));
+		pi->valid = panel_inverse(&_det->panels[i], pi->inv);
+		_versions[i]++;
+		changed = true;
+
+		if (!pi->valid)
+		{
+			ERROR("Failed to solve prediction equation\n");
+		}
+	}
+
+	if (changed)
+	{
+		_transform.update();
+		buildIndex();
+
+		_rayCoeffs.resize(_det->n_panels * RAY_COEFFS);
+
+		for (int i = 0; i < _det->n_panels; i++)
+		{
+			double *c = &_rayCoeffs[i * RAY_COEFFS];
+			memcpy(c, _inverses[i].inv, 9 * sizeof(double));
+			c[9] = _det->panels[i].w;
+			c[10] = _det->panels[i].h;
+		}
+	}
+}
+
+/* Where a panel's rays cross the plane z = 1 (a gnomonic projection, so
+ * tan 2theta along the azimuth). Rays are only known up to sign in the
+ * prediction equation, and so is this. A flat panel whose corners all
+ * lie on one side of z = 0 maps to the convex quad between its projected
+ * corners; any other panel can't be indexed. */
+static bool panel_footprint(struct panel *p, double *umin, double *umax,
+                            double *vmin, double *vmax)
+{
+	*umin = *vmin = +INFINITY;
+	*umax = *vmax = -INFINITY;
+	int above = 0;
+
+	for (int i = 0; i < 4; i++)
+	{
+		double fs = (i & 1) ? p->w : 0;
+		double ss = (i & 2) ? p->h : 0;
+
+		double x = p->cnx + fs * p->fsx + ss * p->ssx;
+		double y = p->cny + fs * p->fsy + ss * p->ssy;
+		double z = p->clen * p->res + fs * p->fsz + ss * p->ssz;
+
+		if (z == 0 || !isfinite(x / z) || !isfinite(y / z))
+		{
+			return false;
+		}
+
+		above += (z > 0);
+		*umin = std::min(*umin, x / z);
+		*umax = std::max(*umax, x / z);
+		*vmin = std::min(*vmin, y / z);
+		*vmax = std::max(*vmax, y / z);
+	}
+
+	return (above == 0 || above == 4);
+}
+
+void Predictor::buildIndex()
+{
+	int n = _det->n_panels;
+	std::vector<double> boxes(n * 4);
+	std::vector<bool> indexed(n, false);
+	double umin = +INFINITY, umax = -INFINITY;
+	double vmin = +INFINITY, vmax = -INFINITY;
+	int count = 0;
+
+	_unindexed.clear();
+
+	for (int i = 0; i < n; i++)
+	{
+		double *b = &boxes[i * 4];
+		indexed[i] = panel_footprint(&_det->panels[i], &b[0], &b[1],
+		                             &b[2], &b[3]);
+
+		if (!indexed[i])
+		{
+			_unindexed.push_back(i);
+			continue;
+		}
+
+		umin = std::min(umin, b[0]);
+		umax = std::max(umax, b[1]);
+		vmin = std::min(vmin, b[2]);
+		vmax = std::max(vmax, b[3]);
+		count++;
+	}
+
+	_nu = 0;
+	_nv = 0;
+	_cellStarts.assign(1, 0);
+	_cellPanels.clear();
+
+	if (count == 0)
+	{
+		return;
+	}
+
+	int cells = ceil(INDEX_DENSITY * sqrt((double)count));
+	cells = std::max(1, std::min(cells, INDEX_MAX_CELLS));
+
+	/* a little slack so rounding never loses a panel at its edge */
+	double slack = 1e-6 * std::max(umax - umin, vmax - vmin) + 1e-12;
+	_u0 = umin - slack;
+	_v0 = vmin - slack;
+	_nu = cells;
+	_nv = cells;
+	_du = (umax - umin + 2 * slack) / cells;
+	_dv = (vmax - vmin + 2 * slack) / cells;
+
+	std::vector<std::vector<int> > lists(_nu * _nv);
+
+	for (int i = 0; i < n; i++)
+	{
+		if (!indexed[i])
+		{
+			continue;
+		}
+
+		double *b = &boxes[i * 4];
+		int u1 = std::max(0, (int)floor((b[0] - slack - _u0) / _du));
+		int u2 = std::min(_nu - 1, (int)floor((b[1] + slack - _u0) / _du));
+		int v1 = std::max(0, (int)floor((b[2] - slack - _v0) / _dv));
+		int v2 = std::min(_nv - 1, (int)floor((b[3] + slack - _v0) / _dv));
+
+		for (int v = v1; v <= v2; v++)
+		{
+			for (int u = u1; u <= u2; u++)
+			{
+				lists[v * _nu + u].push_back(i);
+			}
+		}
+	}
+
+	/* unindexed panels go in every cell too, keeping panel order, so
+	 * that a cell's list is everything a ray through it could hit */
+	for (size_t i = 0; i < lists.size(); i++)
+	{
+		std::vector<int> &l = lists[i];
+		l.insert(l.end(), _unindexed.begin(), _unindexed.end());
+		std::sort(l.begin(), l.end());
+		_cellPanels.insert(_cellPanels.end(), l.begin(), l.end());
+		_cellStarts.push_back(_cellPanels.size());
+	}
+}
+
+static int locate_peak_on_panel(double x, double y, double z, double k,
+                                struct panel *p, const PanelInverse *pi,
+                                double *pfs, double *pss)
+{
+	double fs, ss, one_over_mu;
+
+	if (!pi->valid)
+	{
+		return 0;
+	}
+
+	/* The ray is along (x, y, k + z). This used to go through 2theta
+	 * and phi to make it unit length, but the scale cancels in fs and
+	 * ss, so no trigonometry is needed. */
+	double t0 = x;
+	double t1 = y;
+	double t2 = k + z;
+
+	if (t0 == 0 && t1 == 0 && t2 == 0)
+	{
+		t2 = 1;
+	}
+
+	const double *m = pi->inv;
+	one_over_mu = m[0]*t0 + m[1]*t1 + m[2]*t2;
+	fs = (m[3]*t0 + m[4]*t1 + m[5]*t2) / one_over_mu;
+	ss = (m[6]*t0 + m[7]*t1 + m[8]*t2) / one_over_mu;
+
+	*pfs = fs;  *pss = ss;
+
+	/* Now, is this on this panel? */
+	if ( fs < 0.0 ) return 0;
+	if ( fs >= p->w ) return 0;
+	if ( ss < 0.0 ) return 0;
+	if ( ss >= p->h ) return 0;
+
+	return 1;
+}
+
+/* The panels a ray crossing z = 1 at (u, v) could hit, in detector
+ * order, from its cell in the index. */
+const int *Predictor::candidates(double u, double v, size_t *count)
+{
+	*count = _unindexed.size();
+
+	if (_nu > 0)
+	{
+		/* rays parallel to z = 1 give infinite or NaN u, v and fall
+		 * through to the unindexed panels */
+		double fu = floor((u - _u0) / _du);
+		double fv = floor((v - _v0) / _dv);
+
+		if (fu >= 0 && fu < _nu && fv >= 0 && fv < _nv)
+		{
+			int cell = (int)fv * _nu + (int)fu;
+			*count = _cellStarts[cell + 1] - _cellStarts[cell];
+			return &_cellPanels[_cellStarts[cell]];
+		}
+	}
+
+	return _unindexed.data();
+}
+
+signed int Predictor::locatePeak(double x, double y, double z, double k,
+                                 double *pfs, double *pss)
+{
+	double w = k + z;
+
+	return locateRay(x, y, z, k, x / w, y / w, pfs, pss);
+}
+
+/* Finds the first panel, in detector order, which the ray hits. Only the
+ * panels listed for the ray's cell in the index are tried. */
+signed int Predictor::locateRay(double x, double y, double z, double k,
+                                double u, double v, double *pfs, double *pss)
+{
+	size_t count;
+	const int *list = candidates(u, v, &count);
+
+	*pfs = -1;  *pss = -1;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		int n = list[i];
+		struct panel *p = &_det->panels[n];
+
+		if (locate_peak_on_panel(x, y, z, k, p, &_inverses[n], pfs, pss))
+		{
+			return n;
+		}
+	}
+
+	/* a miss used to leave fs, ss as projected onto the last panel */
+	int last = _det->n_panels - 1;
+	if (last >= 0)
+	{
+		locate_peak_on_panel(x, y, z, k, &_det->panels[last],
+		                     &_inverses[last], pfs, pss);
+	}
+
+	return -1;
+}
+
+/* For a ray which last landed on panel prev, which hasn't moved: only
+ * a moved panel earlier in detector order can now take it instead. */
+signed int Predictor::locateBefore(double x, double y, double z, double k,
+                                   double u, double v, int prev,
+                                   double *pfs, double *pss)
+{
+	size_t count;
+	const int *list = candidates(u, v, &count);
+
+	for (size_t i = 0; i < count && list[i] < prev; i++)
+	{
+		int n = list[i];
+		double fs, ss;
+
+		if (_dirty[n] && locate_peak_on_panel(x, y, z, k, &_det->panels[n],
+		                                      &_inverses[n], &fs, &ss))
+		{
+			*pfs = fs;  *pss = ss;
+			return n;
+		}
+	}
+
+	return -1;
+}
+
+/* misses are filed under panel 0 */
+static void set_prediction(RefColumns *cols, size_t row, signed int p,
+                           double fs, double ss)
+{
+	if (p < 0)
+	{
+		p = 0;
+	}
+
+	cols->fs[row] = fs;
+	cols->ss[row] = ss;
+	cols->panel[row] = p;
+}
+
+void Predictor::predictImage(Session *session, size_t index, bool recalc,
+                             PredictBatch *batch, bool incremental)
+{
+	struct detector *det = _det;
+	struct image *im = session->image(index);
+	ReflectionStore *store = session->reflections();
+	RefColumns *cols = store->columns();
+
+	im->det = det;
+	double knom = 1.0/im->lambda;
+
+	ImageFeatureList *list = im->features;
+	for (int j = 0; j < image_feature_count(list); j++)
+	{
+		struct imagefeature *peak;
+		peak = image_get_feature(list, j);
+		peak->parent = im;
+
+		/* peaks on panels that haven't moved come out the same */
+		if (incremental && !recalc && peak->p != NULL &&
+		    !_dirty[peak->p - det->panels])
+		{
+			continue;
+		}
+		
+		double fs = peak->fs;
+		double ss = peak->ss;
+
+		if (recalc)
+		{
+			signed int pnum = locatePeak(peak->rx, peak->ry, peak->rz, 
+			                             knom, &fs, &ss);
+			
+//			peak->fs = fs;
+//			peak->ss = ss;
+			peak->p = &det->panels[0];
+
+			if (pnum >= 0)
+			{
+				peak->p = &det->panels[pnum];
+			}
+		}
+
+		_transform.add(&batch->pixels, peak, fs, ss, knom);
+	}
+
+	_transform.transform(&batch->pixels);
+
+	size_t last = store->imageCrystal(index + 1);
+
+	for (size_t c = store->imageCrystal(index); c < last; c++)
+	{
+		/* indices are already columns, so go straight in */
+		size_t start = store->crystalStart(c);
+		size_t n = store->crystalStart(c + 1) - start;
+		batch->x.resize(n);
+		batch->y.resize(n);
+		batch->z.resize(n);
+		batch->u.resize(n);
+		batch->v.resize(n);
+
+		predict_lattice(cols->h.data() + start, cols->k.data() + start,
+		                cols->l.data() + start, n, store->crystal(c)->recip,
+		                knom, batch->x.data(), batch->y.data(),
+		                batch->z.data(), batch->u.data(), batch->v.data());
+
+		PanelTransform::clear(&batch->rays);
+
+		for (size_t i = 0; i < n; i++)
+		{
+			double fs, ss;        /* Position on detector */
+			signed int p;         /* Panel number */
+			double x = batch->x[i];
+			double y = batch->y[i];
+			double z = batch->z[i];
+
+			/* misses are filed under panel 0 too, so those and
+			 * anything on a moved panel need the full search */
+			int prev = cols->panel[start + i];
+			if (incremental && prev > 0 && !_dirty[prev])
+			{
+				if (prev < _firstDirty)
+				{
+					continue;
+				}
+
+				p = locateBefore(x, y, z, knom, batch->u[i], batch->v[i],
+				                 prev, &fs, &ss);
+				if (p < 0)
+				{
+					continue;
+				}
+
+				set_prediction(cols, start + i, p, fs, ss);
+				continue;
+			}
+
+			/* tried on the first panel it could hit together with the
+			 * crystal's other rays, unless it can't be projected so */
+			size_t count;
+			const int *list = candidates(batch->u[i], batch->v[i], &count);
+
+			if (count > 0 && _inverses[list[0]].valid &&
+			    !(x == 0 && y == 0 && knom + z == 0))
+			{
+				_transform.add(&batch->rays, start + i, list[0],
+				               x, y, z, knom);
+				continue;
+			}
+
+			p = locateRay(x, y, z, knom, batch->u[i], batch->v[i],
+			              &fs, &ss);
+			set_prediction(cols, start + i, p, fs, ss);
+		}
+
+		ReflectionBatch *rays = &batch->rays;
+		size_t queued = rays->rows.size();
+		rays->fs.resize(queued);
+		rays->ss.resize(queued);
+		batch->hits.resize(queued);
+
+		rays_to_panels(_rayCoeffs.data(), rays->panels.data(),
+		               rays->x.data(), rays->y.data(), rays->z.data(),
+		               rays->k.data(), queued, rays->fs.data(),
+		               rays->ss.data(), batch->hits.data());
+
+		for (size_t j = 0; j < queued; j++)
+		{
+			size_t i = rays->rows[j] - start;
+			double fs = rays->fs[j];
+			double ss = rays->ss[j];
+			signed int p = rays->panels[j];
+
+			/* the rest of the panels, one at a time */
+			if (!batch->hits[j])
+			{
+				p = locateRay(batch->x[i], batch->y[i], batch->z[i], knom,
+				              batch->u[i], batch->v[i], &fs, &ss);
+			}
+
+			set_prediction(cols, start + i, p, fs, ss);
+		}
+	}
+}
+
+/* Images are independent once the panels are fixed, so they are shared
+ * out between threads in runs; each reflection belongs to exactly one
+ * image, so results go straight into its rows. If the whole of the same
+ * set of images was predicted last time, only what involves a panel
+ * which has moved since then is redone. */
+void Predictor::repredict(Session *session, size_t start, bool recalc)
+{
+	updatePanels();
+
+	/* new images' reflections go into the table before anyone writes */
+	session->reflections()->update(session);
+
+	size_t end = session->imageCount();
+	if (end <= start)
+	{
+		return;
+	}
+
+	bool incremental = (start == 0 && session == _lastSession &&
+	                    session->generation() == _lastGeneration &&
+	                    _doneVersions.size() == _versions.size());
+
+	_dirty.assign(_versions.size(), 1);
+	_firstDirty = 0;
+
+	if (incremental)
+	{
+		_firstDirty = _versions.size();
+
+		for (size_t i = 0; i < _versions.size(); i++)
+		{
+			_dirty[i] = (_versions[i] != _doneVersions[i]);
+
+			if (_dirty[i] && (int)i < _firstDirty)
+			{
+				_firstDirty = i;
+			}
+		}
+
+		if (_firstDirty == (int)_versions.size() && !recalc)
+		{
+			return;
+		}
+	}
+
+	size_t total = end - start;
+	size_t jobs = (total + IMAGES_PER_JOB - 1) / IMAGES_PER_JOB;
+
+	run_jobs(jobs, _threads, [&](size_t job)
+	{
+		size_t first = start + job * IMAGES_PER_JOB;
+		size_t last = std::min(first + IMAGES_PER_JOB, end);
+		PredictBatch batch;
+
+		for (size_t i = first; i < last; i++)
+		{
+			predictImage(session, i, recalc, &batch, incremental);
+		}
+	});
+
+	/* a partial run leaves earlier images on older geometry */
+	if (start == 0)
+	{
+		_doneVersions = _versions;
+		_lastSession = session;
+		_lastGeneration = session->generation();
+	}
+	else
+	{
+		_lastSession = NULL;
+	}
+}
@@ -0,0 +1,111 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __slipnslide__Predictor__
+#define __slipnslide__Predictor__
+
+#include <vector>
+#include <crystfel/detector.h>
+#include <crystfel/image.h>
+#include "PanelTransform.h"
+
+class Session;
+
+/* panel parameters the inverse was made from, to spot when it's stale */
+typedef struct
+{
+	double key[PANEL_KEY_SIZE];
+	double inv[9];
+	bool valid;
+} PanelInverse;
+
+/* per-thread scratch: one image's peaks and one crystal's reflections
+ * at a time, as columns, and those of the reflections which go through
+ * rays_to_panels() together */
+typedef struct
+{
+	PixelBatch pixels;
+	std::vector<double> x, y, z;
+	std::vector<double> u, v;
+	ReflectionBatch rays;
+	std::vector<char> hits;
+} PredictBatch;
+
+/* Works out where peaks and reflections land on the current detector
+ * geometry: peak positions in reciprocal space from their pixel
+ * positions, and reflection positions on the panels from the crystal's
+ * reciprocal cell, into the session's reflection table. With recalc
+ * set, peaks are also reassigned to whichever panel their reciprocal
+ * position now falls on. Each panel's
+ * projection matrix is inverted once and kept until that panel moves,
+ * and a grid over the panels' footprints in tan(2theta) space narrows
+ * each ray down to the one or two panels it could land on. A crystal's
+ * reflections are projected onto the first of these together; only
+ * those which miss it are tried on the rest one at a time. Panels carry
+ * a version which goes up whenever they move, so that repredicting the
+ * same images again only redoes what a moved panel could affect. */
+
+class Predictor
+{
+public:
+	Predictor(struct detector *det);
+
+	void setThreads(size_t threads)
+	{
+		_threads = threads;
+	}
+
+	void repredict(Session *session, size_t start, bool recalc);
+private:
+	void updatePanels();
+	void buildIndex();
+	void predictImage(Session *session, size_t index, bool recalc,
+	                  PredictBatch *batch, bool incremental);
+	const int *candidates(double u, double v, size_t *count);
+	signed int locatePeak(double x, double y, double z, double k,
+	                      double *pfs, double *pss);
+	signed int locateRay(double x, double y, double z, double k,
+	                     double u, double v, double *pfs, double *pss);
+	signed int locateBefore(double x, double y, double z, double k,
+	                        double u, double v, int prev,
+	                        double *pfs, double *pss);
+
+	struct detector *_det;
+	size_t _threads;
+	std::vector<PanelInverse> _inverses;
+	std::vector<double> _rayCoeffs;
+	PanelTransform _transform;
+
+	/* grid over where each panel's rays cross z = 1 */
+	double _u0, _v0;
+	double _du, _dv;
+	int _nu, _nv;
+	std::vector<int> _cellStarts;
+	std::vector<int> _cellPanels;
+	std::vector<int> _unindexed;
+
+	/* versions as of the last full pass over _lastSession */
+	std::vector<unsigned long> _versions;
+	std::vector<unsigned long> _doneVersions;
+	std::vector<char> _dirty;
+	int _firstDirty;
+	Session *_lastSession;
+	unsigned long _lastGeneration;
+};
+
+#endif
@@ -17,8 +17,7 @@
 // Please email: vagabond @ hginn.co.uk for more details.
 
 #include "Refine.h"
-#include "SlipPanel.h"
-#include <RefinementNelderMead.h>
+#include "Refiner.h"
 
 Refine::Refine()
 {
@@ -35,45 +34,8 @@ void Refine::setPanel(SlipPanel *p, bool intra)
 
 void Refine::refine()
 {
-	if (_intra)
-	{
-		refineIntra();
-	}
-	else
-	{
-		refineInter();
-	}
-}
-
-void Refine::refineInter()
-{
-	RefinementNelderMead *nm = new RefinementNelderMead();
-	nm->setEvaluationFunction(SlipPanel::getInterScore, _p);
-	nm->addParameter(_p, SlipPanel::getHoriz,
-	                 SlipPanel::setHoriz, 0.001, 0.000005);
-	nm->addParameter(_p, SlipPanel::getVert,
-	                 SlipPanel::setVert, 0.001, 0.000005);
-//	nm->addParameter(_p, SlipPanel::getGamma,
-//	                 SlipPanel::setGamma, 0.001, 0.000005);
-	nm->setCycles(40);
-	nm->refine();
+	Refiner refiner(_p, _intra);
+	refiner.refine();
 	
 	emit resultReady();
 }
-
-void Refine::refineIntra()
-{
-	RefinementNelderMead *nm = new RefinementNelderMead();
-	nm->setEvaluationFunction(SlipPanel::getIntraScore, _p);
-	nm->addParameter(_p, SlipPanel::getRadius,
-	                 SlipPanel::setRadius, 0.0002, 0.000001);
-	nm->addParameter(_p, SlipPanel::getAlpha,
-	                 SlipPanel::setAlpha, 0.0005, 0.000001);
-	nm->addParameter(_p, SlipPanel::getBeta,
-	                 SlipPanel::setBeta, 0.0005, 0.000001);
-	nm->setCycles(40);
-	nm->refine();
-	
-	emit resultReady();
-}
-
@@ -41,9 +41,6 @@ signals:
 public slots:
 	void refine();
 private:
-	void refineIntra();
-	void refineInter();
-
 	bool _intra;
 	SlipPanel *_p;
 	DetectorView *_view;
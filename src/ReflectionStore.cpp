@@ -0,0 +1,85 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "ReflectionStore.h"
+#include "Session.h"
+#include <crystfel/cell.h>
+
+ReflectionStore::ReflectionStore()
+{
+	_imageCrystals.assign(1, 0);
+	_crystalStarts.assign(1, 0);
+}
+
+void ReflectionStore::clear()
+{
+	_imageCrystals.assign(1, 0);
+	_crystalStarts.assign(1, 0);
+	std::vector<StoreCrystal>().swap(_crystals);
+	_cols = RefColumns();
+}
+
+/* Rows only ever go on the end, so rows already handed out stay put. */
+void ReflectionStore::update(Session *session)
+{
+	for (size_t i = imageCount(); i < session->imageCount(); i++)
+	{
+		struct image *im = session->image(i);
+
+		for (int j = 0; j < im->n_crystals; j++)
+		{
+			Crystal *cryst = im->crystals[j];
+			StoreCrystal sc;
+			double *r = sc.recip;
+			cell_get_reciprocal(crystal_get_cell(cryst), &r[0], &r[1], &r[2],
+			                    &r[3], &r[4], &r[5], &r[6], &r[7], &r[8]);
+			sc.k = 1.0 / im->lambda;
+			sc.image = i;
+
+			int c = _crystals.size();
+			_crystals.push_back(sc);
+
+			RefListIterator *it;
+			RefList *refs = crystal_get_reflections(cryst);
+
+			for (Reflection *ref = first_refl(refs, &it); ref != NULL;
+			     ref = next_refl(ref, it))
+			{
+				signed int h, k, l;
+				double fs, ss;
+				get_symmetric_indices(ref, &h, &k, &l);
+				get_detector_pos(ref, &fs, &ss);
+				struct panel *p = get_panel(ref);
+
+				_cols.h.push_back(h);
+				_cols.k.push_back(k);
+				_cols.l.push_back(l);
+				_cols.intensity.push_back(get_intensity(ref));
+				_cols.fs.push_back(fs);
+				_cols.ss.push_back(ss);
+				_cols.panel.push_back(p == NULL ? -1 : p - im->det->panels);
+				_cols.crystal.push_back(c);
+				_cols.refs.push_back(ref);
+			}
+
+			_crystalStarts.push_back(_cols.h.size());
+		}
+
+		_imageCrystals.push_back(_crystals.size());
+	}
+}
@@ -0,0 +1,109 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __slipnslide__ReflectionStore__
+#define __slipnslide__ReflectionStore__
+
+#include <vector>
+#include <crystfel/image.h>
+#include <crystfel/reflist.h>
+
+class Session;
+
+/* one column per field of the reflections, all in the same row order */
+typedef struct
+{
+	std::vector<int> h, k, l;       /* symmetric indices */
+	std::vector<double> intensity;
+	std::vector<double> fs, ss;     /* predicted position on the panel */
+	std::vector<int> panel;         /* predicted panel, or -1 */
+	std::vector<int> crystal;
+	std::vector<Reflection *> refs; /* where each row came from */
+} RefColumns;
+
+/* what's needed to predict a crystal's reflections */
+typedef struct
+{
+	double recip[9];   /* astar, bstar, cstar in m^-1 */
+	double k;          /* 1 / wavelength in m^-1 */
+	int image;
+} StoreCrystal;
+
+/* Every reflection of every crystal in a session, copied out of the
+ * CrystFEL reflection lists once after loading and held as columns, in
+ * image order, then crystal order. Crystals are numbered as in the
+ * session, and the rows of crystal c run from crystalStart(c) to
+ * crystalStart(c + 1). Predictions are made into the columns and are
+ * not written back to the reflection lists, which keep what was read
+ * from the stream. */
+
+class ReflectionStore
+{
+public:
+	ReflectionStore();
+
+	/* brings in images added to the session since last time */
+	void update(Session *session);
+	void clear();
+
+	size_t imageCount()
+	{
+		return _imageCrystals.size() - 1;
+	}
+
+	size_t crystalCount()
+	{
+		return _crystals.size();
+	}
+
+	StoreCrystal *crystal(size_t c)
+	{
+		return &_crystals[c];
+	}
+
+	/* first crystal of the image */
+	size_t imageCrystal(size_t image)
+	{
+		return _imageCrystals[image];
+	}
+
+	size_t crystalStart(size_t c)
+	{
+		return _crystalStarts[c];
+	}
+
+	size_t rowCount()
+	{
+		return _cols.h.size();
+	}
+
+	RefColumns *columns()
+	{
+		return &_cols;
+	}
+private:
+	ReflectionStore(const ReflectionStore &other);
+	ReflectionStore &operator=(const ReflectionStore &other);
+
+	std::vector<size_t> _imageCrystals;
+	std::vector<size_t> _crystalStarts;
+	std::vector<StoreCrystal> _crystals;
+	RefColumns _cols;
+};
+
+#endif
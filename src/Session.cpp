@@ -0,0 +1,119 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "Session.h"
+#include <stdlib.h>
+#include <crystfel/events.h>
+#include <crystfel/reflist.h>
+#include <crystfel/cell.h>
+
+Session::Session()
+{
+	_generation = 0;
+}
+
+Session::~Session()
+{
+	clear();
+}
+
+void Session::reserve(size_t images)
+{
+	_images.reserve(images);
+}
+
+void Session::addCrystals(struct image *im)
+{
+	im->spectrum = spectrum_generate_gaussian(im->lambda, im->bw);
+
+	for (int i = 0; i < im->n_crystals; i++)
+	{
+		Crystal *cr = im->crystals[i];
+
+		/* single-crystal view of the image, sharing its peaks and
+		 * pointing into its crystal array, which never moves */
+		struct image *copy = _crystalImages.push_back(*im);
+		copy->n_crystals = 1;
+		copy->crystals = &im->crystals[i];
+		crystal_set_image(cr, copy);
+
+		_crystals.push_back(cr);
+	}
+}
+
+void Session::addImages(std::vector<struct image> *batch)
+{
+	size_t first = _images.size();
+	_images.append(batch);
+	_generation++;
+
+	for (size_t i = first; i < _images.size(); i++)
+	{
+		struct image *im = &_images[i];
+		ImageFeatureList *list = im->features;
+
+		for (int j = 0; j < image_feature_count(list); j++)
+		{
+			image_get_feature(list, j)->parent = im;
+		}
+
+		addCrystals(im);
+	}
+}
+
+void Session::freeImage(struct image *im)
+{
+	for (int i = 0; i < im->n_crystals; i++)
+	{
+		Crystal *cr = im->crystals[i];
+		reflist_free(crystal_get_reflections(cr));
+		cell_free(crystal_get_cell(cr));
+		crystal_free(cr);
+	}
+
+	free(im->crystals);
+	image_feature_list_free(im->features);
+	free(im->filename);
+
+	/* only made once the image is added */
+	if (im->spectrum != NULL)
+	{
+		spectrum_free(im->spectrum);
+	}
+
+	if (im->event != NULL)
+	{
+		free_event(im->event);
+	}
+}
+
+void Session::clear()
+{
+	_peaks.clear();
+	_reflections.clear();
+
+	for (size_t i = 0; i < _images.size(); i++)
+	{
+		freeImage(&_images[i]);
+	}
+
+	_images.clear();
+	_crystalImages.clear();
+	_generation++;
+	std::vector<Crystal *>().swap(_crystals);
+}
@@ -0,0 +1,97 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __slipnslide__Session__
+#define __slipnslide__Session__
+
+#include <vector>
+#include <crystfel/image.h>
+#include "ImageStore.h"
+#include "PeakStore.h"
+#include "ReflectionStore.h"
+
+/* Owns everything loaded from a stream: the images, the single-crystal
+ * image headers which each Crystal points back to, and a table of every
+ * crystal. Per-crystal headers come out of their own block arena rather
+ * than one malloc each. The peak and reflection tables live here too,
+ * though they are only filled when asked. clear() hands all of it back,
+ * down to the CrystFEL peak lists, cells and reflection lists. */
+
+class Session
+{
+public:
+	Session();
+	~Session();
+
+	size_t imageCount()
+	{
+		return _images.size();
+	}
+
+	struct image *image(size_t i)
+	{
+		return &_images[i];
+	}
+
+	size_t crystalCount()
+	{
+		return _crystals.size();
+	}
+
+	Crystal *crystal(size_t i)
+	{
+		return _crystals[i];
+	}
+
+	PeakStore *peaks()
+	{
+		return &_peaks;
+	}
+
+	ReflectionStore *reflections()
+	{
+		return &_reflections;
+	}
+
+	/* goes up whenever images are added or cleared */
+	unsigned long generation()
+	{
+		return _generation;
+	}
+
+	void reserve(size_t images);
+	void addImages(std::vector<struct image> *batch);
+	void clear();
+
+	/* everything an image read from a stream owns, even half-read */
+	static void freeImage(struct image *im);
+private:
+	Session(const Session &other);
+	Session &operator=(const Session &other);
+
+	void addCrystals(struct image *im);
+
+	ImageStore _images;
+	ImageStore _crystalImages;
+	std::vector<Crystal *> _crystals;
+	PeakStore _peaks;
+	ReflectionStore _reflections;
+	unsigned long _generation;
+};
+
+#endif
@@ -23,30 +23,34 @@
 #include "vec_utils.h"
 #include <mat3x3.h>
 #include "SlipPanel.h"
-#include "SlipObject.h"
-#include "Curve.h"
-#include "CurveView.h"
-#include "Overview.h"
-#include "shaders/vari_z.h"
-#include <crystfel/reflist.h>
-#include <crystfel/geometry.h>
-
-#define DESELECTED_COLOUR (0.5)
-#define SELECTED_COLOUR (1.0)
-
-using namespace Helen3D;
+#include "predict_kernel.h"
+#include "thread_utils.h"
+#include <string.h>
+#include <math.h>
+#include <algorithm>
 
 size_t SlipPanel::_maxImages = 20;
 double SlipPanel::_minIntensity = 200;
+double SlipPanel::_intraCutoff = INTRA_CUTOFF;
+size_t SlipPanel::_threads = thread_count();
+PeakStore *SlipPanel::_store = NULL;
+ReflectionStore *SlipPanel::_reflections = NULL;
 
 void SlipPanel::initialise()
 {
-	_target = NULL;
 	_single = false;
 	_isSelected = false;
+	_highlighted = false;
 	_panel = NULL;
+	_index = -1;
 	_backup = NULL;
-	_overview = NULL;
+	_transform = NULL;
+	_storeGeneration = 0;
+	_lastBound = 0;
+	_changed = NULL;
+	_changedObject = NULL;
+	_accepted = NULL;
+	_acceptedObject = NULL;
 	_radius = 0;
 	_horiz = 0;
 	_vert = 0;
@@ -55,17 +59,15 @@ void SlipPanel::initialise()
 	_gamma = 0;
 }
 
-SlipPanel::SlipPanel(struct panel *p) : SlipObject()
+SlipPanel::SlipPanel(struct panel *p, int index)
 {
 	initialise();
 	_single = true;
 	_panel = p;
+	_index = index;
+	setMemberBit(index);
 	makePanelBackup();
 	updateTmpPanelValues();
-	createVertices();
-
-	_vString = variable_z_vsh();
-	_fString = variable_z_fsh();
 }
 
 SlipPanel::SlipPanel()
@@ -73,6 +75,11 @@ SlipPanel::SlipPanel()
 	initialise();
 }
 
+SlipPanel::~SlipPanel()
+{
+	delete _transform;
+}
+
 void SlipPanel::addPanel(SlipPanel *other)
 {
 	if (_single)
@@ -82,10 +89,11 @@ void SlipPanel::addPanel(SlipPanel *other)
 
 	if (isSelected())
 	{
-		other->recolour(SELECTED_COLOUR, 0, 0);
+		other->setHighlighted(true);
 	}
 	
 	_subpanels.push_back(other);
+	mergeMembers(other);
 }
 
 void SlipPanel::makePanelBackup()
@@ -184,7 +192,6 @@ void SlipPanel::nudgePanel(SlipPanel *parent)
 	_panel->ssz = ss.z;
 	
 	updateTmpPanelValues();
-	updateVertices();
 }
 
 void SlipPanel::acceptNudges(SlipPanel *parent)
@@ -209,7 +216,6 @@ void SlipPanel::acceptNudges(SlipPanel *parent)
 		_horiz = 0;
 		_vert = 0;
 		updateTmpPanelValues();
-		updateVertices();
 	}
 	
 	for (size_t i = 0; i < _subpanels.size(); i++)
@@ -217,9 +223,9 @@ void SlipPanel::acceptNudges(SlipPanel *parent)
 		_subpanels[i]->acceptNudges(parent);
 	}
 	
-	if (top && _overview != NULL)
+	if (top && _accepted != NULL)
 	{
-		_overview->resetSliders();
+		_accepted(_acceptedObject);
 	}
 }
 
@@ -288,6 +294,11 @@ void SlipPanel::updateTmpPanelValues()
 	plus = make_vec3(_backup->ssx, _backup->ssy, _backup->ssz);
 	vec3_mult(&plus, _panel->h / _panel->res / 2);
 	vec3_add_to_vec3(&_centre, plus);
+
+	if (_changed != NULL)
+	{
+		_changed(_changedObject);
+	}
 }
 
 std::vector<SlipPanel *> SlipPanel::split(struct detector *det)
@@ -351,7 +362,7 @@ std::vector<SlipPanel *> SlipPanel::split(struct detector *det)
 
 	for (int i = start; i < start + 3; i++)
 	{
-		SlipPanel *slip = new SlipPanel(&det->panels[i]);
+		SlipPanel *slip = new SlipPanel(&det->panels[i], i);
 		extras.push_back(slip);
 	}
 	
@@ -361,255 +372,550 @@ std::vector<SlipPanel *> SlipPanel::split(struct detector *det)
 	return extras;
 }
 
-void SlipPanel::createVertices()
+void SlipPanel::setMemberBit(int index)
 {
-	if (_single == false)
+	if (index < 0)
 	{
 		return;
 	}
 
-	_vertices.clear();
-	_indices.clear();
-	
-	_indices.push_back(0);
-	_indices.push_back(1);
-	_indices.push_back(2);
-	_indices.push_back(2);
-	_indices.push_back(1);
-	_indices.push_back(3);
-	
-	Vertex v;
-	memset(v.pos, 0, sizeof(Vertex));
+	size_t word = index / 64;
+	if (word >= _memberBits.size())
+	{
+		_memberBits.resize(word + 1, 0);
+	}
 
-	v.color[0] = 0.5;
-	v.color[3] = 1;
-	_vertices.push_back(v);
-	_vertices.push_back(v);
-	_vertices.push_back(v);
-	_vertices.push_back(v);
+	_memberBits[word] |= (uint64_t)1 << (index % 64);
+}
 
-	updateVertices();
+void SlipPanel::mergeMembers(SlipPanel *other)
+{
+	if (other->_memberBits.size() > _memberBits.size())
+	{
+		_memberBits.resize(other->_memberBits.size(), 0);
+	}
+
+	for (size_t i = 0; i < other->_memberBits.size(); i++)
+	{
+		_memberBits[i] |= other->_memberBits[i];
+	}
 }
 
-void SlipPanel::updateVertices()
+/* after a removal, as another subpanel may still cover the same bits */
+void SlipPanel::rebuildMembers()
 {
-	if (_single == false)
+	_memberBits.clear();
+
+	for (size_t i = 0; i < _subpanels.size(); i++)
 	{
-		return;
+		mergeMembers(_subpanels[i]);
 	}
+}
 
-	lockMutex();
-	pos_from_vec(_vertices[0].pos, _corner);
-	vec3 fcorn = _fs;
-	vec3_mult(&fcorn, _width);
-	vec3_add_to_vec3(&fcorn, _corner);
-	pos_from_vec(_vertices[1].pos, fcorn);
+void SlipPanel::addImages(size_t end)
+{
+	if (end <= _images.size())
+	{
+		return;
+	}
 
-	vec3 scorn = _ss;
-	vec3_mult(&scorn, _height);
-	vec3_add_to_vec3(&scorn, _corner);
-	pos_from_vec(_vertices[2].pos, scorn);
+	/* pairs are rebuilt from the new set of images when next needed */
+	_pairs.clear();
+	dropPairCache();
 
-	fcorn = _fs;
-	vec3_mult(&fcorn, _width);
-	vec3_add_to_vec3(&scorn, fcorn);
-	pos_from_vec(_vertices[3].pos, scorn);
-	unlockMutex();
+	for (size_t i = _images.size(); i < end; i++)
+	{
+		_images.push_back(_store->image(i));
+	}
 }
 
-bool SlipPanel::isValidPanelMember(struct panel *p)
+/* the rows of each member panel in the store, up to the last image this
+ * panel has been given */
+void SlipPanel::updateView()
 {
-	if (_single)
+	_members.clear();
+	_rowStarts.clear();
+	_rowEnds.clear();
+
+	if (_store == NULL || _store->detector() == NULL)
 	{
-		return (p == panelPtr());
+		return;
 	}
 
-	for (size_t i = 0; i < _subpanels.size(); i++)
+	for (size_t w = 0; w < _memberBits.size(); w++)
 	{
-		if (_subpanels[i]->isValidPanelMember(p))
+		for (int b = 0; b < 64; b++)
 		{
-			return true;
+			if ((_memberBits[w] >> b) & 1)
+			{
+				_members.push_back(w * 64 + b);
+			}
 		}
 	}
-	
-	return false;
+
+	for (size_t i = 0; i < _members.size(); i++)
+	{
+		_rowStarts.push_back(_store->panelStart(_members[i]));
+		_rowEnds.push_back(_store->imageStart(_members[i], _images.size()));
+	}
 }
 
-void SlipPanel::getPeaksFromImage(struct image *im)
+void SlipPanel::dropPairCache()
 {
-	ImageFeatureList *list = im->features;
-	size_t start = _peaks.size();
+	_panelRefs.clear();
+	_panelPairs.clear();
+	_paired.clear();
+	_pairKeys.clear();
+}
 
-	for (int i = 0; i < image_feature_count(list); i++)
+bool SlipPanel::pairCacheValid()
+{
+	return (_store != NULL && _panelRefs.size() > 0 &&
+	        _storeGeneration == _store->generation());
+}
+
+/* Reflections bright enough to pair, sorted onto the panels they were
+ * predicted on, so that each panel can later be paired by itself. */
+void SlipPanel::bucketReflections()
+{
+	int np = _store->panelCount();
+	_panelRefs.clear();
+	_panelRefs.resize(np);
+	_panelPairs.clear();
+	_panelPairs.resize(np);
+	_paired.assign(np, 0);
+	_pairKeys.assign(np * PANEL_KEY_SIZE, NAN);
+	_storeGeneration = _store->generation();
+
+	size_t images = std::min(_images.size(), _maxImages);
+	images = std::min(images, _reflections->imageCount());
+
+	/* the first images' rows come first */
+	RefColumns *refs = _reflections->columns();
+	size_t end = _reflections->crystalStart(_reflections->imageCrystal(images));
+
+	for (size_t r = 0; r < end; r++)
 	{
-		struct imagefeature *peak;
-		peak = image_get_feature(list, i);
-		peak->parent = im;
-		
-		if (isValidPanelMember(peak->p))
+		int p = refs->panel[r];
+
+		if (refs->intensity[r] < _minIntensity || p < 0)
 		{
-			_peaks.push_back(*peak);
+			continue;
 		}
+
+		PanelRef pr;
+		pr.ref = r;
+		pr.image = _reflections->crystal(refs->crystal[r])->image;
+		_panelRefs[p].push_back(pr);
 	}
+}
 
-	size_t end = _peaks.size();
-	
-	_images.push_back(im);
+static void reciprocal_position(ReflectionStore *store, size_t row,
+                                double *x, double *y, double *z)
+{
+	RefColumns *c = store->columns();
+	int h = c->h[row];
+	int k = c->k[row];
+	int l = c->l[row];
+
+	const double *r = store->crystal(c->crystal[row])->recip;
+	*x = h * r[0] + k * r[3] + l * r[6];
+	*y = h * r[1] + k * r[4] + l * r[7];
+	*z = h * r[2] + k * r[5] + l * r[8];
+}
+
+/* Pairs for the reflections of one panel against its own peaks, after
+ * projecting them onto the panel where it is now. The transform must
+ * be up to date. */
+void SlipPanel::pairPanel(int panel)
+{
+	buildPeakIndex(panel);
+
+	PeakColumns *cols = _store->columns();
+	RefColumns *rcols = _reflections->columns();
+	std::vector<PanelRef> &refs = _panelRefs[panel];
+	std::vector<RefPeak> &pairs = _panelPairs[panel];
+	pairs.clear();
+
+	for (size_t i = 0; i < refs.size(); i++)
+	{
+		double x, y, z;
+		size_t r = refs[i].ref;
+		double k = _reflections->crystal(rcols->crystal[r])->k;
+		reciprocal_position(_reflections, r, &x, &y, &z);
+		_transform->add(&_projection, r, panel, x, y, z, k);
+	}
+
+	_transform->project(&_projection, rcols);
+
+	for (size_t i = 0; i < refs.size(); i++)
+	{
+		size_t r = refs[i].ref;
+		size_t row;
+
+		if (!findClosestPeak(refs[i].image, _projection.fs[i],
+		                     _projection.ss[i], &row))
+		{
+			continue;
+		}
+
+		double x, y, z;
+		reciprocal_position(_reflections, r, &x, &y, &z);
+
+		RefPeak rp;
+		rp.ref = r;
+		rp.peak = row;
+		rp.recip = make_vec3(x, y, z);
+		rp.k = _reflections->crystal(rcols->crystal[r])->k;
+		pairs.push_back(rp);
+	}
+
+	_paired[panel] = 1;
+	panel_key(&_store->detector()->panels[panel],
+	          &_pairKeys[panel * PANEL_KEY_SIZE]);
+}
 
-	if (start == 0)
+/* whether a panel's pairs were made where the panel is now */
+bool SlipPanel::pairsCurrent(int panel)
+{
+	if (!_paired[panel])
 	{
-		_imageStarts.push_back(start);
+		return false;
 	}
 
-	_imageStarts.push_back(end);
+	double key[PANEL_KEY_SIZE];
+	panel_key(&_store->detector()->panels[panel], key);
+
+	return (memcmp(key, &_pairKeys[panel * PANEL_KEY_SIZE],
+	               sizeof(key)) == 0);
 }
 
+/* the group's pairs are those of its members, each paired only once for
+ * as long as the images stay the same */
 void SlipPanel::updatePairs()
 {
 	_pairs.clear();
-	int count = 0;
-	
-	double asx, asy, asz;
-	double bsx, bsy, bsz;
-	double csx, csy, csz;
 
-	for (size_t i = 0; i < _images.size() && i < _maxImages; i++)
+	if (_store == NULL || _store->detector() == NULL || _reflections == NULL)
+	{
+		return;
+	}
+
+	if (!pairCacheValid())
 	{
-		struct image *im = _images[i];
+		bucketReflections();
+	}
+
+	updateView();
+	updateTransform();
 
-		for (int j = 0; j < im->n_crystals; j++)
+	for (size_t i = 0; i < _members.size(); i++)
+	{
+		int m = _members[i];
+
+		if (!pairsCurrent(m))
 		{
-			Crystal *cryst = im->crystals[j];
-			RefListIterator *it;
-			RefList *refs = crystal_get_reflections(cryst);
-			Reflection *ref = first_refl(refs, &it);
-			UnitCell *cell = crystal_get_cell(cryst);
+			pairPanel(m);
+		}
 
-			cell_get_reciprocal(cell, &asx, &asy, &asz,
-			                    &bsx, &bsy, &bsz,
-			                    &csx, &csy, &csz);
+		_pairs.insert(_pairs.end(), _panelPairs[m].begin(),
+		              _panelPairs[m].end());
+	}
+}
 
-			if (ref == NULL)
+/* After a change of members, drops the pairs of panels which went and
+ * adds those of panels which came, leaving the rest alone unless one of
+ * them has moved since it was paired. */
+void SlipPanel::changePairs(const std::vector<uint64_t> &before)
+{
+	if (_pairs.size() == 0 || !pairCacheValid())
+	{
+		/* built from scratch when next needed */
+		_pairs.clear();
+		return;
+	}
+
+	for (size_t w = 0; w < before.size() && w < _memberBits.size(); w++)
+	{
+		uint64_t kept = before[w] & _memberBits[w];
+
+		for (int b = 0; b < 64; b++)
+		{
+			if (((kept >> b) & 1) && !pairsCurrent(w * 64 + b))
 			{
-				continue;
+				updatePairs();
+				return;
 			}
+		}
+	}
+
+	std::vector<uint64_t> gone(before.size(), 0);
+	bool removed = false;
 
-			while (true)
+	for (size_t w = 0; w < before.size(); w++)
+	{
+		uint64_t now = (w < _memberBits.size() ? _memberBits[w] : 0);
+		gone[w] = before[w] & ~now;
+		removed |= (gone[w] != 0);
+	}
+
+	if (removed)
+	{
+		PeakColumns *c = _store->columns();
+		size_t kept = 0;
+
+		for (size_t i = 0; i < _pairs.size(); i++)
+		{
+			int p = c->panel[_pairs[i].peak];
+
+			if ((gone[p / 64] >> (p % 64)) & 1)
 			{
-				ref = (next_refl(ref, it));
-				if (ref == NULL)
-				{
-					break;
-				}
+				continue;
+			}
 
-				if (get_intensity(ref) < _minIntensity)
-				{
-					continue;
-				}
-				
-				count++;
+			_pairs[kept++] = _pairs[i];
+		}
 
-				struct panel *p = get_panel(ref);
-				if (p != NULL && !isValidPanelMember(p))
-				{
-					continue;
-				}
+		_pairs.resize(kept);
+	}
 
-				double fs, ss;
-				get_detector_pos(ref, &fs, &ss);
+	updateTransform();
 
-				struct imagefeature *peak = findClosestPeak(im, p, 
-				                                            fs, ss);
+	for (size_t w = 0; w < _memberBits.size(); w++)
+	{
+		uint64_t old = (w < before.size() ? before[w] : 0);
+		uint64_t added = _memberBits[w] & ~old;
 
-				if (peak == NULL)
-				{
-					continue;
-				}
+		for (int b = 0; b < 64; b++)
+		{
+			if (!((added >> b) & 1))
+			{
+				continue;
+			}
 
-				set_temp1(ref, peak->fs);
-				set_temp2(ref, peak->ss);
+			int m = w * 64 + b;
 
-				RefPeak rp;
-				rp.ref = ref;
-				rp.peak = peak;
-				_pairs.push_back(rp);
+			if (!pairsCurrent(m))
+			{
+				pairPanel(m);
 			}
+
+			_pairs.insert(_pairs.end(), _panelPairs[m].begin(),
+			              _panelPairs[m].end());
 		}
 	}
+}
+
+void SlipPanel::updateTransform()
+{
+	struct detector *det = _store->detector();
+
+	if (_transform == NULL || _transform->detector() != det)
+	{
+		delete _transform;
+		_transform = new PanelTransform(det);
+	}
+	else
+	{
+		_transform->update();
+	}
+}
+
+/* Repredicts only the reflections in the pairs, each onto the panel it
+ * was paired on, straight from the reciprocal position kept with the
+ * pair. The positions land in _projection, one for each pair in order;
+ * the reflection store, which Predictor relies on, is left alone. */
+void SlipPanel::projectPairs()
+{
+	if (_pairs.size() == 0)
+	{
+		return;
+	}
+
+	if (_transform == NULL || _transform->detector() != _store->detector())
+	{
+		updateTransform();
+	}
+
+	PeakColumns *cols = _store->columns();
 
-	std::cout << "Tested: " << count << std::endl;
+	for (size_t i = 0; i < _pairs.size(); i++)
+	{
+		RefPeak *rp = &_pairs[i];
+		_transform->add(&_projection, rp->ref, cols->panel[rp->peak],
+		                rp->recip.x, rp->recip.y, rp->recip.z, rp->k);
+	}
+
+	_transform->project(&_projection, _reflections->columns());
 }
 
 void SlipPanel::updatePeaks()
 {
-	for (size_t i = 0; i < _peaks.size(); i++)
+	updateView();
+
+	if (_members.size() == 0)
 	{
-		struct imagefeature *peak = &_peaks[i];
-		struct image *im = peak->parent;
+		return;
+	}
+
+	updateTransform();
 
-		double k = 1e-10 / im->lambda; /* inverse Angs */
-		double fs = peak->fs;
-		double ss = peak->ss;
-		panel *p = peak->p;
+	/* each member's rows are contiguous, so go straight through them */
+	PeakColumns *c = _store->columns();
+	for (size_t i = 0; i < _members.size(); i++)
+	{
+		size_t start = _rowStarts[i];
+		size_t n = _rowEnds[i] - start;
 
-		/* Calculate 3D position of given position, in m */ 
-		double x = (p->cnx  + fs*p->fsx + ss*p->ssx);
-		x /= p->res;
-		double y = (p->cny  + fs*p->fsy + ss*p->ssy);
-		y /= p->res;
-		double z = (fs*p->fsz + ss*p->ssz);
-		z /= p->res;
-		z += (p->clen + p->coffset);
-		
-		vec3 v = make_vec3(x, y, z);
+		_transform->transform(c->panel.data() + start, c->fs.data() + start,
+		                      c->ss.data() + start, c->k.data() + start, n,
+		                      c->rx.data() + start, c->ry.data() + start,
+		                      c->rz.data() + start);
+	}
+}
 
-		vec3_set_length(&v, k);
+/* cell along one side of a grid; anything off the panel goes in the
+ * cell at the edge, which keeps neighbours within one cell */
+static int grid_cell(double pos, int n)
+{
+	double c = floor(pos / PAIR_RADIUS);
 
-		peak->rx = v.x;
-		peak->ry = v.y;
-		peak->rz = v.z - k;
+	if (!(c >= 0))
+	{
+		return 0;
 	}
+
+	return (c >= n ? n - 1 : (int)c);
 }
 
-struct imagefeature *SlipPanel::findClosestPeak(struct image *im,
-                                                struct panel *p,
-                                                double fs, double ss)
+static bool grid_before(const PeakGrid &grid, int image)
 {
-	double closest = FLT_MAX;
-	struct imagefeature *peak = NULL;
-	const double max = 5;
+	return grid.image < image;
+}
+
+/* The panel's rows are already in image order, so each run of one
+ * image gets a grid of PAIR_RADIUS cells, all kept as one set of
+ * offsets into _gridPeaks. */
+void SlipPanel::buildPeakIndex(int panel)
+{
+	_grids.clear();
+	_gridCells.assign(1, 0);
+	_gridPeaks.clear();
+
+	std::vector<int> cells;
+	std::vector<size_t> fill;
+
+	PeakColumns *c = _store->columns();
+	struct panel *p = &_store->detector()->panels[panel];
+	size_t end = _store->imageStart(panel, _images.size());
 
-	for (size_t i = 0; i < _peaks.size(); i++)
+	for (size_t a = _store->panelStart(panel); a < end; )
 	{
-		if (_peaks[i].parent != im || _peaks[i].p != p)
+		size_t b = a;
+		while (b < end && c->image[b] == c->image[a])
 		{
-			continue;
+			b++;
 		}
 
-		double dfs = (_peaks[i].fs - fs);
-		
-		if (dfs > max || dfs < -max)
+		PeakGrid grid;
+		grid.image = c->image[a];
+		grid.cellStart = _gridCells.size() - 1;
+		grid.nx = p->w / PAIR_RADIUS + 1;
+		grid.ny = p->h / PAIR_RADIUS + 1;
+		_grids.push_back(grid);
+
+		size_t total = grid.nx * grid.ny;
+		size_t base = _gridPeaks.size();
+		cells.resize(b - a);
+		fill.assign(total, 0);
+
+		for (size_t i = a; i < b; i++)
 		{
-			continue;
+			int cx = grid_cell(c->fs[i], grid.nx);
+			int cy = grid_cell(c->ss[i], grid.ny);
+			cells[i - a] = cy * grid.nx + cx;
+			fill[cells[i - a]]++;
 		}
 
-		double dss = (_peaks[i].ss - ss);
-		
-		if (dss > max || dss < -max)
+		size_t offset = base;
+		for (size_t j = 0; j < total; j++)
 		{
-			continue;
+			size_t count = fill[j];
+			fill[j] = offset;
+			offset += count;
+			_gridCells.push_back(offset);
 		}
-		
-		double dist = dfs * dfs + dss * dss;
-		
-		if (dist < closest)
+
+		/* in row order within each cell */
+		_gridPeaks.resize(offset);
+		for (size_t i = a; i < b; i++)
 		{
-			closest = dist;
-			peak = &_peaks[i];
+			_gridPeaks[fill[cells[i - a]]++] = i;
 		}
+
+		a = b;
 	}
+}
 
-	return peak;
+/* Nearest peak of the image on the panel being paired, within PAIR_RADIUS
+ * in both fs and ss, which can only be in the 3 x 3 cells around it. Ties
+ * go to whichever peak came first, as when every peak was scanned. */
+bool SlipPanel::findClosestPeak(size_t image, double fs, double ss,
+                                size_t *row)
+{
+	PeakGrid *first = _grids.data();
+	PeakGrid *last = _grids.data() + _grids.size();
+	PeakGrid *grid = std::lower_bound(first, last, (int)image, grid_before);
+
+	if (grid == last || grid->image != (int)image)
+	{
+		return false;
+	}
+
+	PeakColumns *c = _store->columns();
+	double closest = FLT_MAX;
+	bool found = false;
+	const double max = PAIR_RADIUS;
+	int cx = grid_cell(fs, grid->nx);
+	int cy = grid_cell(ss, grid->ny);
+
+	for (int y = std::max(cy - 1, 0); y <= std::min(cy + 1, grid->ny - 1); y++)
+	{
+		for (int x = std::max(cx - 1, 0); x <= std::min(cx + 1, grid->nx - 1);
+		     x++)
+		{
+			size_t cell = grid->cellStart + y * grid->nx + x;
+
+			for (size_t j = _gridCells[cell]; j < _gridCells[cell + 1]; j++)
+			{
+				size_t i = _gridPeaks[j];
+				double dfs = (c->fs[i] - fs);
+
+				if (dfs > max || dfs < -max)
+				{
+					continue;
+				}
+
+				double dss = (c->ss[i] - ss);
+
+				if (dss > max || dss < -max)
+				{
+					continue;
+				}
+
+				double dist = dfs * dfs + dss * dss;
+
+				if (dist < closest || (found && dist == closest && i < *row))
+				{
+					closest = dist;
+					*row = i;
+					found = true;
+				}
+			}
+		}
+	}
+
+	return found;
 }
 
 vec3 SlipPanel::rayTraceToPanel(struct panel *p, vec3 dir)
@@ -631,26 +937,6 @@ vec3 SlipPanel::rayTraceToPanel(struct panel *p, vec3 dir)
 	return dir;   
 }  
 
-void SlipPanel::updateTarget(Curve *c, bool refresh)
-{
-	prepareTarget(refresh);
-
-	c->clear();
-	c->setPointData(true);
-	_target = c;
-
-	for (size_t i = 0; i < _xs.size(); i++)
-	{
-		double dx = _xs[i];
-		double dy = _ys[i];
-		
-		c->addDataPoint(dx, dy);
-	}
-
-	CurveView *cv = c->getCurveView();
-	cv->redraw();
-}
-
 void SlipPanel::prepareTarget(bool refresh)
 {
 	if (refresh)
@@ -658,107 +944,242 @@ void SlipPanel::prepareTarget(bool refresh)
 		updatePeaks();
 	}
 
-	if (_pairs.size() == 0)
+	/* rows held by the pairs go stale if the store takes in more */
+	if (_pairs.size() == 0 || !pairCacheValid())
 	{
 		updatePairs();
 	}
 	
 	_xs.clear();
 	_ys.clear();
-	
-	for (size_t i = 0; i < _images.size() && i < _maxImages; i++)
-	{
-		struct image *im = _images[i];
+	projectPairs();
 
-		for (int j = 0; j < im->n_crystals; j++)
-		{
-			Crystal *cryst = im->crystals[j];
-			crystal_set_image(cryst, im);
-			update_predictions(cryst);
-		}
-	}
+	PeakColumns *peaks = _store->columns();
 
 	for (size_t i = 0; i < _pairs.size(); i++)
 	{
-		Reflection *ref = _pairs[i].ref;
+		size_t p = _pairs[i].peak;
 
-		double fs, ss;
-		get_detector_pos(ref, &fs, &ss);
-		double pfs = get_temp1(ref);
-		double pss = get_temp2(ref);
-		double dx = fs - pfs;
-		double dy = ss - pss;
+		double dx = _projection.fs[i] - peaks->fs[p];
+		double dy = _projection.ss[i] - peaks->ss[p];
 		_xs.push_back(dx);
 		_ys.push_back(dy);
 	}
 }
 
-void SlipPanel::updatePowder(Curve *c, bool refresh)
+/* cell list for one image's peaks in reciprocal space, kept between
+ * images so that it only grows */
+typedef struct
 {
-	if (refresh)
+	std::vector<size_t> points;
+	std::vector<int> cells;
+	std::vector<size_t> starts;
+	std::vector<size_t> order;
+} PowderCells;
+
+/* Adds the distance between every pair of the peaks in pc->points which
+ * are within range of each other to hist. Peaks are binned on a grid at
+ * least range wide, so each is only compared with those in its own and
+ * the neighbouring cells ahead of it. */
+static void powder_image(PeakColumns *cols, double slicing, int bins,
+                         double *hist, PowderCells *pc)
+{
+	double range = bins * slicing;
+	double lo[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+	double hi[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+	const double *rx = cols->rx.data();
+	const double *ry = cols->ry.data();
+	const double *rz = cols->rz.data();
+	size_t n = pc->points.size();
+
+	if (n < 2)
 	{
-		updatePeaks();
+		return;
 	}
-	
-	double slicing = 0.00005;
-	double range = 0.1;
-	int bins = range / slicing + 1;
-	double *vals = new double[bins];
-	memset(vals, '\0', sizeof(double) * bins);
-	
-	for (size_t k = 1; k < _imageStarts.size(); k++)
+
+	for (size_t i = 0; i < n; i++)
 	{
-		size_t start = _imageStarts[k - 1];
-		size_t end = _imageStarts[k];
+		size_t row = pc->points[i];
+		double r[3] = {rx[row], ry[row], rz[row]};
 
-		for (size_t i = start + 1; i < end; i++)
+		for (int j = 0; j < 3; j++)
 		{
-			if (_peaks[i].intensity < _minIntensity)
-			{
-				continue;
-			}
+			lo[j] = std::min(lo[j], r[j]);
+			hi[j] = std::max(hi[j], r[j]);
+		}
+	}
+
+	int side = cbrt((double)n) * 2 + 1;
+	double width = 0;
+	for (int j = 0; j < 3; j++)
+	{
+		width = std::max(width, hi[j] - lo[j]);
+	}
+
+	double cell = std::max(range, width / side);
+	int dims[3];
+	for (int j = 0; j < 3; j++)
+	{
+		dims[j] = (hi[j] - lo[j]) / cell + 1;
+	}
+
+	int total = dims[0] * dims[1] * dims[2];
+	pc->cells.resize(n);
+	pc->order.resize(n);
+	pc->starts.assign(total + 1, 0);
+
+	for (size_t i = 0; i < n; i++)
+	{
+		size_t row = pc->points[i];
+		double r[3] = {rx[row], ry[row], rz[row]};
+		int c[3];
+
+		for (int j = 0; j < 3; j++)
+		{
+			c[j] = std::min((int)((r[j] - lo[j]) / cell), dims[j] - 1);
+		}
+
+		pc->cells[i] = (c[2] * dims[1] + c[1]) * dims[0] + c[0];
+		pc->starts[pc->cells[i] + 1]++;
+	}
+
+	for (int i = 0; i < total; i++)
+	{
+		pc->starts[i + 1] += pc->starts[i];
+	}
+
+	for (size_t i = 0; i < n; i++)
+	{
+		pc->order[pc->starts[pc->cells[i]]++] = pc->points[i];
+	}
+
+	/* filling moved each start on to the next one; move them back */
+	for (int i = total; i > 0; i--)
+	{
+		pc->starts[i] = pc->starts[i - 1];
+	}
+	pc->starts[0] = 0;
 
-			for (size_t j = start; j < i; j++)
+	for (int cz = 0; cz < dims[2]; cz++)
+	{
+		for (int cy = 0; cy < dims[1]; cy++)
+		{
+			for (int cx = 0; cx < dims[0]; cx++)
 			{
-				if (_peaks[j].intensity < _minIntensity)
+				int c = (cz * dims[1] + cy) * dims[0] + cx;
+
+				/* this cell and the 13 of its 26 neighbours which come
+				 * after it, so that each pair of cells is seen once */
+				for (int d = 13; d < 27; d++)
 				{
-					continue;
+					int ox = cx + d % 3 - 1;
+					int oy = cy + (d / 3) % 3 - 1;
+					int oz = cz + d / 9 - 1;
+
+					if (ox < 0 || ox >= dims[0] || oy < 0 ||
+					    oy >= dims[1] || oz >= dims[2])
+					{
+						continue;
+					}
+
+					int o = (oz * dims[1] + oy) * dims[0] + ox;
+
+					for (size_t i = pc->starts[c]; i < pc->starts[c + 1]; i++)
+					{
+						size_t a = pc->order[i];
+						size_t j = (d == 13 ? i + 1 : pc->starts[o]);
+
+						for (; j < pc->starts[o + 1]; j++)
+						{
+							size_t b = pc->order[j];
+							double dx = rx[b] - rx[a];
+							double dy = ry[b] - ry[a];
+							double dz = rz[b] - rz[a];
+							double l = sqrt(dx * dx + dy * dy + dz * dz);
+							int bin = l / slicing;
+
+							if (bin >= bins || bin < 0)
+							{
+								continue;
+							}
+
+							hist[bin]++;
+						}
+					}
 				}
+			}
+		}
+	}
+}
+
+/* Images are shared out between threads in runs, each filling its own
+ * histogram, and the histograms are added up in order at the end. */
+void SlipPanel::updatePowder(std::vector<double> *vals, bool refresh)
+{
+	if (refresh)
+	{
+		updatePeaks();
+	}
+	
+	double slicing = POWDER_SLICING;
+	double range = POWDER_RANGE;
+	int bins = range / slicing + 1;
+	vals->assign(bins, 0);
+	updateView();
+
+	size_t images = _images.size();
+	size_t jobs = std::min(_threads, images);
+	if (jobs == 0 || _members.size() == 0)
+	{
+		return;
+	}
+
+	_powderBins.assign(jobs * bins, 0);
+	PeakColumns *cols = _store->columns();
 
-				vec3 diff = make_vec3(_peaks[j].rx - _peaks[i].rx,
-				                      _peaks[j].ry - _peaks[i].ry,
-				                      _peaks[j].rz - _peaks[i].rz);
+	run_jobs(jobs, _threads, [&](size_t job)
+	{
+		PowderCells cells;
+		double *hist = &_powderBins[job * bins];
+		size_t first = (images * job) / jobs;
+		size_t last = (images * (job + 1)) / jobs;
+
+		/* where each member's rows for the next image start */
+		std::vector<size_t> next(_members.size());
+		for (size_t m = 0; m < _members.size(); m++)
+		{
+			next[m] = _store->imageStart(_members[m], first);
+		}
 
-				double l = vec3_length(diff);
-				int bin = l / slicing;
+		for (size_t k = first; k < last; k++)
+		{
+			cells.points.clear();
 
-				if (bin >= bins || bin < 0) 
+			for (size_t m = 0; m < _members.size(); m++)
+			{
+				for (; next[m] < _rowEnds[m] &&
+				     cols->image[next[m]] == (int)k; next[m]++)
 				{
-					continue;
+					if (cols->intensity[next[m]] >= _minIntensity)
+					{
+						cells.points.push_back(next[m]);
+					}
 				}
-
-				vals[bin]++;
 			}
+
+			powder_image(cols, slicing, bins, hist, &cells);
 		}
-	}
+	});
 
-	c->clear();
-	int max = 0;
-	for (int i = 0; i < bins; i++)
+	for (size_t job = 0; job < jobs; job++)
 	{
-		c->addDataPoint((double)i * slicing, vals[i]);
-		
-		if (vals[i] > max)
+		double *hist = &_powderBins[job * bins];
+
+		for (int i = 0; i < bins; i++)
 		{
-			max = vals[i];
+			(*vals)[i] += hist[i];
 		}
 	}
-	
-	delete [] vals;
-	
-	CurveView *cv = c->getCurveView();
-	cv->setWindow(-range/10, -(double)max/10, range, (double)max*1.1);
-	cv->redraw();
 }
 
 std::string SlipPanel::shortDesc()
@@ -774,17 +1195,26 @@ std::string SlipPanel::shortDesc()
 void SlipPanel::setSelected(bool sel)
 {
 	_isSelected = sel;
-	
-	double colour = sel ? SELECTED_COLOUR: DESELECTED_COLOUR;
 
 	for (size_t i = 0; i < _subpanels.size(); i++)
 	{
-		_subpanels[i]->recolour(colour, 0, 0);
+		_subpanels[i]->setHighlighted(sel);
+	}
+}
+
+void SlipPanel::setHighlighted(bool highlight)
+{
+	_highlighted = highlight;
+
+	if (_changed != NULL)
+	{
+		_changed(_changedObject);
 	}
 }
 
 void SlipPanel::togglePanel(SlipPanel *other)
 {
+	std::vector<uint64_t> before = _memberBits;
 	std::vector<SlipPanel *>::iterator it;
 	it = std::find(_subpanels.begin(), _subpanels.end(), other);
 	
@@ -794,9 +1224,12 @@ void SlipPanel::togglePanel(SlipPanel *other)
 	}
 	else
 	{
-		(*it)->recolour(DESELECTED_COLOUR, 0, 0);
+		(*it)->setHighlighted(false);
 		_subpanels.erase(it);
+		rebuildMembers();
 	}
+
+	changePairs(before);
 }
 
 void SlipPanel::clearPanels()
@@ -808,6 +1241,21 @@ void SlipPanel::clearPanels()
 	_isSelected = tmp;
 
 	_subpanels.clear();
+	_memberBits.clear();
+	_pairs.clear();
+}
+
+/* pairwise, so that the rounding doesn't grow with the number of
+ * blocks and doesn't depend on which thread finished first */
+static double pairwise_sum(const double *vals, size_t n)
+{
+	if (n <= 2)
+	{
+		return (n == 0 ? 0 : (n == 1 ? vals[0] : vals[0] + vals[1]));
+	}
+
+	size_t half = n / 2;
+	return pairwise_sum(vals, half) + pairwise_sum(vals + half, n - half);
 }
 
 double SlipPanel::interScore()
@@ -815,49 +1263,155 @@ double SlipPanel::interScore()
 	nudgePanels();
 	prepareTarget(true);
 
-	double sum = 0;
-	for (size_t i = 1; i < _xs.size(); i++)
+	size_t n = _xs.size();
+	size_t blocks = (n + SCORE_BLOCK - 1) / SCORE_BLOCK;
+	std::vector<double> sums(blocks, 0);
+
+	/* blocks are fixed in size whatever the thread count */
+	run_jobs(blocks, _threads, [&](size_t block)
 	{
-		double x1 = _xs[i];
-		double y1 = _ys[i];
+		size_t start = block * SCORE_BLOCK;
+		size_t count = std::min((size_t)SCORE_BLOCK, n - start);
+		sums[block] = gaussian_sum(&_xs[start], &_ys[start], count, 2);
+	});
 
-		double dist = x1 * x1 + y1 * y1;
-		double add = exp(-2 * dist);
-		sum += add;
-	}
+	double sum = pairwise_sum(sums.data(), blocks);
 
-	std::cout << -sum << std::endl;
 	return -sum;
 }
 
-double SlipPanel::intraScore()
+/* Sum of exp(-2 * d^2 / modifier) over every pair of points, only
+ * counting pairs closer than cutoff. Points are binned on a grid of
+ * cells at least cutoff wide, so each point need only be compared with
+ * those in its own and the next cells along. Whatever was left out is
+ * no more than the number of skipped pairs times the value at cutoff,
+ * which goes into *bound. */
+static double gaussian_pair_sum(std::vector<double> &xs,
+                                std::vector<double> &ys,
+                                double modifier, double cutoff,
+                                double *bound)
 {
-	nudgePanels();
-	prepareTarget(true);
+	std::vector<size_t> points;
+	double xmin = FLT_MAX, xmax = -FLT_MAX;
+	double ymin = FLT_MAX, ymax = -FLT_MAX;
 
-	double modifier = 3;
+	for (size_t i = 0; i < xs.size(); i++)
+	{
+		/* too far from anything to count */
+		if (!isfinite(xs[i]) || !isfinite(ys[i]))
+		{
+			continue;
+		}
+
+		points.push_back(i);
+		xmin = std::min(xmin, xs[i]);
+		xmax = std::max(xmax, xs[i]);
+		ymin = std::min(ymin, ys[i]);
+		ymax = std::max(ymax, ys[i]);
+	}
+
+	size_t n = points.size();
+	double pairs = (double)xs.size() * (xs.size() - 1) / 2;
+	double counted = 0;
 	double sum = 0;
-	for (size_t i = 1; i < _xs.size(); i++)
+
+	if (n < 2)
+	{
+		*bound = pairs * exp(-2 * cutoff * cutoff / modifier);
+		return 0;
+	}
+
+	/* outliers stretch the grid; cells get wider rather than more */
+	int side = sqrt((double)n) * 2 + 1;
+	double cell = std::max(cutoff, std::max(xmax - xmin, ymax - ymin) / side);
+	int nx = (xmax - xmin) / cell + 1;
+	int ny = (ymax - ymin) / cell + 1;
+
+	std::vector<int> cells(n);
+	std::vector<size_t> starts(nx * ny + 1, 0);
+	std::vector<size_t> order(n);
+
+	for (size_t i = 0; i < n; i++)
+	{
+		int cx = std::min((int)((xs[points[i]] - xmin) / cell), nx - 1);
+		int cy = std::min((int)((ys[points[i]] - ymin) / cell), ny - 1);
+		cells[i] = cy * nx + cx;
+		starts[cells[i] + 1]++;
+	}
+
+	for (int i = 0; i < nx * ny; i++)
+	{
+		starts[i + 1] += starts[i];
+	}
+
+	std::vector<size_t> fill(starts.begin(), starts.end() - 1);
+	for (size_t i = 0; i < n; i++)
+	{
+		order[fill[cells[i]]++] = points[i];
+	}
+
+	double cut2 = cutoff * cutoff;
+	/* this cell, then the four ahead of it, so each pair comes up once */
+	const int dxs[] = {0, 1, -1, 0, 1};
+	const int dys[] = {0, 0, 1, 1, 1};
+
+	for (int cy = 0; cy < ny; cy++)
 	{
-		double x1 = _xs[i];
-		double y1 = _ys[i];
-		
-		for (size_t j = 0; j < i; j++)
+		for (int cx = 0; cx < nx; cx++)
 		{
-			double x2 = _xs[j];
-			double y2 = _ys[j];
-			
-			double dx = x2 - x1;
-			double dy = y2 - y1;
-		
-			double dist = dx * dx + dy * dy;
-			dist /= modifier;
-			double add = exp(-2 * dist);
-			sum += add;
+			int c = cy * nx + cx;
+
+			for (int d = 0; d < 5; d++)
+			{
+				int ox = cx + dxs[d];
+				int oy = cy + dys[d];
+
+				if (ox < 0 || ox >= nx || oy >= ny)
+				{
+					continue;
+				}
+
+				int o = oy * nx + ox;
+
+				for (size_t i = starts[c]; i < starts[c + 1]; i++)
+				{
+					double x1 = xs[order[i]];
+					double y1 = ys[order[i]];
+					size_t j = (d == 0 ? i + 1 : starts[o]);
+
+					for (; j < starts[o + 1]; j++)
+					{
+						double dx = xs[order[j]] - x1;
+						double dy = ys[order[j]] - y1;
+						double dist = dx * dx + dy * dy;
+
+						if (dist >= cut2)
+						{
+							continue;
+						}
+
+						sum += exp(-2 * dist / modifier);
+						counted++;
+					}
+				}
+			}
 		}
 	}
 
-	std::cout << -sum << std::endl;
+	*bound = (pairs - counted) * exp(-2 * cut2 / modifier);
+	return sum;
+}
+
+double SlipPanel::intraScore()
+{
+	nudgePanels();
+	prepareTarget(true);
+
+	double modifier = 3;
+	double bound = 0;
+	double sum = gaussian_pair_sum(_xs, _ys, modifier, _intraCutoff, &bound);
+
+	_lastBound = bound;
 	return -sum;
 }
 
@@ -19,26 +19,75 @@
 #ifndef __Slip__SlipPanel__
 #define __Slip__SlipPanel__
 
-#include "SlipObject.h"
 #include "vec3.h"
+#include <string>
+#include <vector>
+#include <stdint.h>
 #include <crystfel/detector.h>
 #include <crystfel/image.h>
+#include "PanelTransform.h"
+#include "PeakStore.h"
+#include "ReflectionStore.h"
 
+/* bins of the powder pattern, in inverse Angstroms */
+#define POWDER_SLICING (0.00005)
+#define POWDER_RANGE (0.1)
+
+/* residuals further apart than this, in pixels, are left out of the
+ * intra-panel score; exp(-2 * 36 / 3) is about 4e-11 */
+#define INTRA_CUTOFF (6.0)
+
+/* residuals per job when scoring across threads */
+#define SCORE_BLOCK (4096)
+
+/* how far, in pixels, a peak may be from a reflection to be paired */
+#define PAIR_RADIUS (5.0)
+
+/* the peaks of one image on one panel, on a grid of PAIR_RADIUS cells */
 typedef struct
 {
-	Reflection *ref;
-	struct imagefeature *peak;
-	vec3 recip;
+	int image;
+	size_t cellStart;   /* index of the first cell in _gridCells */
+	int nx;
+	int ny;
+} PeakGrid;
+
+/* The reflection's reciprocal lattice position only depends on the
+ * crystal, which never moves while panels are refined, so it is kept
+ * here for projecting straight onto the panel at each evaluation. */
+typedef struct
+{
+	size_t ref;        /* row in the reflection store */
+	size_t peak;       /* row in the peak store */
+	vec3 recip;        /* m^-1 */
+	double k;          /* 1 / wavelength in m^-1 */
 } RefPeak;
 
-class Curve;
-class Overview;
+/* a reflection bright enough to pair, waiting on its panel */
+typedef struct
+{
+	size_t ref;        /* row in the reflection store */
+	int image;
+} PanelRef;
+
+typedef void (*PanelHandler)(void *object);
 
-class SlipPanel : public SlipObject
+/* A single detector panel, or a group of them which are moved and refined
+ * together. Sees the peaks of the images it has been given through the
+ * rows of its member panels in the shared peak store, holds the
+ * pairs between those and rows of the reflection store, and scores how
+ * well they line up. Nothing here draws:
+ * whoever shows a panel registers a change handler, called whenever the
+ * panel moves or is (de)highlighted, and a group's accept handler is
+ * called when its nudges are accepted. */
+
+class SlipPanel
 {
 public:
-	SlipPanel(struct panel *p);
+	/* index is the panel's place in the detector */
+	SlipPanel(struct panel *p, int index);
 	SlipPanel();
+	~SlipPanel();
 	
 	void addPanel(SlipPanel *other);	
 	void togglePanel(SlipPanel *other);
@@ -57,10 +106,24 @@ public:
 	
 	void clearImageData()
 	{
-		_peaks.clear();
 		_pairs.clear();
 		_images.clear();
-		_imageStarts.clear();
+		_members.clear();
+		_rowStarts.clear();
+		_rowEnds.clear();
+		dropPairCache();
+	}
+
+	/* every panel looks at the peaks in this store */
+	static void setPeakStore(PeakStore *store)
+	{
+		_store = store;
+	}
+
+	/* and pairs them with the reflections in this one */
+	static void setReflectionStore(ReflectionStore *store)
+	{
+		_reflections = store;
 	}
 	
 	static void setMaxImages(size_t max)
@@ -72,6 +135,23 @@ public:
 	{
 		_minIntensity = min;
 	}
+
+	static void setIntraCutoff(double cutoff)
+	{
+		_intraCutoff = cutoff;
+	}
+
+	static void setThreads(size_t threads)
+	{
+		_threads = threads;
+	}
+
+	/* most the latest intra-panel score could be out by from the
+	 * cutoff */
+	double lastBound()
+	{
+		return _lastBound;
+	}
 	
 	size_t panelCount()
 	{
@@ -86,10 +166,49 @@ public:
 	{
 		return _isSelected;
 	}
+
+	/* part of a selected group */
+	bool isHighlighted()
+	{
+		return _highlighted;
+	}
+	
+	void setChangeHandler(PanelHandler handler, void *object)
+	{
+		_changed = handler;
+		_changedObject = object;
+	}
 	
-	void setOverview(Overview *o)
+	void setAcceptHandler(PanelHandler handler, void *object)
 	{
-		_overview = o;
+		_accepted = handler;
+		_acceptedObject = object;
+	}
+
+	/* corner, axes and size as drawn, in mm */
+	vec3 corner()
+	{
+		return _corner;
+	}
+
+	vec3 fastAxis()
+	{
+		return _fs;
+	}
+
+	vec3 slowAxis()
+	{
+		return _ss;
+	}
+
+	double width()
+	{
+		return _width;
+	}
+
+	double height()
+	{
+		return _height;
 	}
 	
 	static double getRadius(void *object)
@@ -154,20 +273,33 @@ public:
 
 	void addToZ(double metres);
 	void updateTmpPanelValues();
-	void updateVertices();
-	void createVertices();
 
 	std::vector<SlipPanel *> split(struct detector *det);
 
 	void acceptNudges(SlipPanel *parent = NULL);
 	void nudgePanels(SlipPanel *parent = NULL);
 	
-	void getPeaksFromImage(struct image *im);
+	/* takes on the store's images up to end, in store order */
+	void addImages(size_t end);
 	
-	void updatePowder(Curve *c, bool refresh = true);
-	void updateTarget(Curve *c, bool refresh = true);
+	void updatePowder(std::vector<double> *vals, bool refresh = true);
 	void prepareTarget(bool refresh);
 
+	size_t targetCount()
+	{
+		return _xs.size();
+	}
+
+	double targetX(size_t i)
+	{
+		return _xs[i];
+	}
+
+	double targetY(size_t i)
+	{
+		return _ys[i];
+	}
+
 	void cOffsetToLen(double defDist);
 	void cLenToOffset(double defDist);
 
@@ -182,15 +314,33 @@ public:
 	}
 
 protected:
-	struct imagefeature *findClosestPeak(struct image *im,
-	                                     struct panel *p,
-	                                     double fs, double ss);
+	bool findClosestPeak(size_t image, double fs, double ss, size_t *row);
 	vec3 rayTraceToPanel(struct panel *p, vec3 dir);
-	bool isValidPanelMember(struct panel *p);
+	/* a single bit lookup, whatever the size of the group */
+	bool isValidPanelMember(int index)
+	{
+		size_t word = index / 64;
+		return (index >= 0 && word < _memberBits.size() &&
+		        ((_memberBits[word] >> (index % 64)) & 1));
+	}
+
 	double intraScore();
 	double interScore();
 	void updatePeaks();
+	void updateTransform();
+	void projectPairs();
 	void updatePairs();
+	void changePairs(const std::vector<uint64_t> &before);
+	void bucketReflections();
+	void pairPanel(int panel);
+	bool pairsCurrent(int panel);
+	void dropPairCache();
+	bool pairCacheValid();
+	void buildPeakIndex(int panel);
+	void updateView();
+	void setMemberBit(int index);
+	void mergeMembers(SlipPanel *other);
+	void rebuildMembers();
 
 	struct panel *panelPtr()
 	{
@@ -201,6 +351,7 @@ private:
 	void restoreFromBackup();
 	void nudgePanel(SlipPanel *parent);
 	void initialise();
+	void setHighlighted(bool highlight);
 	vec3 centroid();
 
 	vec3 _corner;      /* in mm */
@@ -219,22 +370,60 @@ private:
 	double _horiz;
 	double _vert;
 	
-	Overview *_overview;
-	Curve *_target;
+	PanelHandler _changed;
+	void *_changedObject;
+	PanelHandler _accepted;
+	void *_acceptedObject;
 
 	bool _isSelected;
+	bool _highlighted;
 	bool _single;
 	static size_t _maxImages;
 	static double _minIntensity;
+	static double _intraCutoff;
+	static size_t _threads;
+	static PeakStore *_store;
+	static ReflectionStore *_reflections;
+	double _lastBound;
 	struct panel *_panel;
+	int _index;
 	struct panel *_backup;
 	std::vector<SlipPanel *> _subpanels;
 	std::vector<double> _xs, _ys;
 
-	std::vector<struct imagefeature> _peaks;
+	PanelTransform *_transform;
 	std::vector<struct image *> _images;
 	std::vector<RefPeak> _pairs;
-	std::vector<size_t> _imageStarts;
+	std::vector<double> _powderBins;
+
+	/* bit i set for every panel index i in the group, kept up to date
+	 * as panels are added and removed */
+	std::vector<uint64_t> _memberBits;
+
+	/* member panels, in order, and their rows in the store for the
+	 * images given so far */
+	std::vector<int> _members;
+	std::vector<size_t> _rowStarts;
+	std::vector<size_t> _rowEnds;
+
+	/* reflections and the pairs made from them, for each panel of the
+	 * detector, kept until the images or the store's rows change; a
+	 * panel is paired again if it has moved since, going by its
+	 * panel_key() at the time */
+	std::vector<std::vector<PanelRef> > _panelRefs;
+	std::vector<std::vector<RefPeak> > _panelPairs;
+	std::vector<char> _paired;
+	std::vector<double> _pairKeys;
+	unsigned long _storeGeneration;
+
+	/* scratch for projecting reflections, left holding the fs, ss of
+	 * the last lot projected */
+	ReflectionBatch _projection;
+
+	/* grids of the panel being paired, by image */
+	std::vector<PeakGrid> _grids;
+	std::vector<size_t> _gridCells;
+	std::vector<size_t> _gridPeaks;
 };
 
 #endif
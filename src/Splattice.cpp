@@ -17,48 +17,57 @@
 // Please email: vagabond @ hginn.co.uk for more details.
 
 #include "Splattice.h"
-#include <vec3.h>
+#include "Session.h"
 
 Splattice::Splattice(Overview *view)
 {
 	_view = view;
-
+	_transform = NULL;
 }
 
-void Splattice::addImage(struct image *im)
+Splattice::~Splattice()
 {
-	ImageFeatureList *list = im->features;
+	delete _transform;
+}
 
-	for (int i = 0; i < image_feature_count(list); i++)
+void Splattice::addImages(Session *session, size_t start)
+{
+	for (size_t j = start; j < session->imageCount(); j++)
 	{
-		struct imagefeature *peak;
-		peak = image_get_feature(list, i);
-		peak->parent = im;
-		
-		double fs = peak->fs;
-		double ss = peak->ss;
+		struct image *im = session->image(j);
+		ImageFeatureList *list = im->features;
 		double k = 1e-10 / im->lambda; /* inverse Angs */
-		panel *p = peak->p;
 
-		/* Calculate 3D position of given position, in m */ 
-		double x = (p->cnx  + fs*p->fsx + ss*p->ssx);
-		x /= p->res;
-		double y = (p->cny  + fs*p->fsy + ss*p->ssy);
-		y /= p->res;
-		double z = (fs*p->fsz + ss*p->ssz);
-		z /= p->res;
-		z += (p->clen + p->coffset);
-		
-		vec3 v = make_vec3(x, y, z);
+		if (_transform == NULL || _transform->detector() != im->det)
+		{
+			if (_transform != NULL)
+			{
+				_transform->transform(&_batch);
+			}
+
+			delete _transform;
+			_transform = new PanelTransform(im->det);
+		}
+		else if (j == start)
+		{
+			_transform->update();
+		}
 
-		vec3_set_length(&v, k);
+		for (int i = 0; i < image_feature_count(list); i++)
+		{
+			struct imagefeature *peak;
+			peak = image_get_feature(list, i);
+			peak->parent = im;
 
-		// in inverse Angstroms
-		peak->rx = v.x;
-		peak->ry = v.y;
-		peak->rz = v.z - k;
-		
-		_peaks.push_back(peak);
+			_transform->add(&_batch, peak, k);
+			_peaks.push_back(peak);
+		}
+	}
+
+	// in inverse Angstroms
+	if (_transform != NULL)
+	{
+		_transform->transform(&_batch);
 	}
 }
 
@@ -22,21 +22,32 @@
 #include <crystfel/image.h>
 #include <vector>
 #include <QObject>
+#include "PanelTransform.h"
 
 class Overview;
+class Session;
 
 class Splattice : public QObject
 {
 Q_OBJECT
 public:
 	Splattice(Overview *view);
+	~Splattice();
 
-	void addImage(struct image *im);
+	/* every image in the session from start onwards */
+	void addImages(Session *session, size_t start);
+
+	void clear()
+	{
+		_peaks.clear();
+	}
 
 public slots:
 	void runSplattice();
 private:
 	Overview *_view;
+	PanelTransform *_transform;
+	PixelBatch _batch;
 
 	std::vector<struct imagefeature *> _peaks;
 };
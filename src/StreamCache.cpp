@@ -0,0 +1,692 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "StreamCache.h"
+#include "thread_utils.h"
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <crystfel/utils.h>
+#include <crystfel/events.h>
+#include <crystfel/reflist.h>
+#include <crystfel/cell.h>
+
+#define CACHE_MAGIC "SNSCACHE"
+#define CACHE_VERSION 1
+#define NO_STRING UINT64_MAX
+
+/* bytes hashed from each end of the stream */
+#define HASH_SPAN (1 << 20)
+
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t n_panels;
+	uint64_t source_size;
+	int64_t source_mtime;
+	int64_t source_mtime_ns;
+	uint64_t source_hash;
+	uint64_t geom_hash;
+	double max_adu;
+	uint64_t n_images;
+	uint64_t n_peaks;
+	uint64_t n_crystals;
+	uint64_t n_refls;
+	uint64_t n_chars;
+} CacheHeader;
+
+typedef struct
+{
+	double lambda;
+	double div;
+	double bw;
+	double avg_clen;
+	double peak_resolution;
+	uint64_t filename;
+	uint64_t event;
+	uint64_t first_peak;
+	uint64_t first_crystal;
+	int32_t serial;
+	int32_t n_peaks;      /* -1 if the image had no peak list */
+	int32_t n_crystals;
+	int32_t pad;
+} CacheImage;
+
+typedef struct
+{
+	double recip[9];
+	double profile_radius;
+	double shift_x;
+	double shift_y;
+	uint64_t first_refl;
+	uint64_t n_refls;
+	int32_t lattice;
+	char centering;
+	char unique_axis;
+	char pad[2];
+} CacheCrystal;
+
+struct CacheColumns
+{
+	std::vector<CacheImage> ims;
+	std::vector<double> pfs, pss, pint;
+	std::vector<int32_t> ppanel;
+	std::vector<uint32_t> pimage;
+	std::vector<CacheCrystal> crys;
+	std::vector<int32_t> h, k, l, sh, sk, sl, rpanel;
+	std::vector<double> rint, rsig, rpeak, rbg, rfs, rss;
+	std::vector<char> chars;
+};
+
+static uint64_t fnv1a(const void *data, size_t len, uint64_t hash)
+{
+	const unsigned char *p = (const unsigned char *)data;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+static size_t pad8(size_t bytes)
+{
+	return (bytes + 7) & ~(size_t)7;
+}
+
+StreamCache::StreamCache(std::string streamFile, struct detector *det,
+                         double max_adu)
+{
+	_streamFile = streamFile;
+	_cacheFile = streamFile + ".slipcache";
+	_det = det;
+	_maxADU = max_adu;
+	_size = 0;
+	_mtime = 0;
+	_mtimeNs = 0;
+	_hash = 0;
+	_cols = new CacheColumns();
+}
+
+StreamCache::~StreamCache()
+{
+	delete _cols;
+}
+
+bool StreamCache::sourceDetails()
+{
+	int fd = open(_streamFile.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	_size = st.st_size;
+	_mtime = st.st_mtim.tv_sec;
+	_mtimeNs = st.st_mtim.tv_nsec;
+
+	/* the head and tail of the stream, so that a rewrite within the
+	 * same second with the same length is still noticed */
+	std::vector<char> buf(HASH_SPAN);
+	uint64_t hash = fnv1a(&_size, sizeof(_size), 14695981039346656037ULL);
+
+	ssize_t got = pread(fd, &buf[0], HASH_SPAN, 0);
+	if (got > 0)
+	{
+		hash = fnv1a(&buf[0], got, hash);
+	}
+
+	if (_size > HASH_SPAN)
+	{
+		got = pread(fd, &buf[0], HASH_SPAN, _size - HASH_SPAN);
+		if (got > 0)
+		{
+			hash = fnv1a(&buf[0], got, hash);
+		}
+	}
+
+	_hash = hash;
+	close(fd);
+
+	return true;
+}
+
+uint64_t StreamCache::geometryHash()
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (int i = 0; i < _det->n_panels; i++)
+	{
+		struct panel *p = &_det->panels[i];
+		hash = fnv1a(p->name, strlen(p->name) + 1, hash);
+		hash = fnv1a(&p->orig_min_fs, sizeof(p->orig_min_fs), hash);
+		hash = fnv1a(&p->orig_min_ss, sizeof(p->orig_min_ss), hash);
+	}
+
+	return hash;
+}
+
+static int32_t panel_index(struct detector *det, struct panel *p)
+{
+	if (p == NULL)
+	{
+		return -1;
+	}
+
+	return p - det->panels;
+}
+
+static uint64_t add_string(std::vector<char> *chars, const char *str)
+{
+	if (str == NULL)
+	{
+		return NO_STRING;
+	}
+
+	uint64_t off = chars->size();
+	chars->insert(chars->end(), str, str + strlen(str) + 1);
+
+	return off;
+}
+
+static bool write_block(FILE *fh, const void *data, size_t bytes)
+{
+	const char zeros[8] = {0};
+
+	if (bytes > 0 && fwrite(data, 1, bytes, fh) != bytes)
+	{
+		return false;
+	}
+
+	size_t extra = pad8(bytes) - bytes;
+	return (fwrite(zeros, 1, extra, fh) == extra);
+}
+
+template <typename T>
+static bool write_column(FILE *fh, std::vector<T> &col)
+{
+	return write_block(fh, col.size() ? &col[0] : NULL,
+	                   col.size() * sizeof(T));
+}
+
+void StreamCache::collect(std::vector<struct image> *images)
+{
+	CacheColumns *c = _cols;
+
+	for (size_t i = 0; i < images->size(); i++)
+	{
+		struct image *im = &images->at(i);
+		CacheImage ci;
+		memset(&ci, 0, sizeof(CacheImage));
+
+		ci.lambda = im->lambda;
+		ci.div = im->div;
+		ci.bw = im->bw;
+		ci.avg_clen = im->avg_clen;
+		ci.peak_resolution = im->peak_resolution;
+		ci.serial = im->serial;
+		ci.filename = add_string(&c->chars, im->filename);
+		ci.event = NO_STRING;
+
+		if (im->event != NULL)
+		{
+			char *ev = get_event_string(im->event);
+			ci.event = add_string(&c->chars, ev);
+			free(ev);
+		}
+
+		ci.first_peak = c->pfs.size();
+		ci.n_peaks = -1;
+
+		if (im->features != NULL)
+		{
+			ci.n_peaks = image_feature_count(im->features);
+		}
+
+		for (int j = 0; j < ci.n_peaks; j++)
+		{
+			struct imagefeature *f = image_get_feature(im->features, j);
+			c->pfs.push_back(f->fs);
+			c->pss.push_back(f->ss);
+			c->pint.push_back(f->intensity);
+			c->ppanel.push_back(panel_index(_det, f->p));
+			c->pimage.push_back(c->ims.size());
+		}
+
+		ci.first_crystal = c->crys.size();
+		ci.n_crystals = im->n_crystals;
+
+		for (int j = 0; j < im->n_crystals; j++)
+		{
+			Crystal *cr = im->crystals[j];
+			UnitCell *cell = crystal_get_cell(cr);
+			CacheCrystal cc;
+			memset(&cc, 0, sizeof(CacheCrystal));
+
+			double *r = cc.recip;
+			cell_get_reciprocal(cell, &r[0], &r[1], &r[2], &r[3], &r[4],
+			                    &r[5], &r[6], &r[7], &r[8]);
+			cc.lattice = cell_get_lattice_type(cell);
+			cc.centering = cell_get_centering(cell);
+			cc.unique_axis = cell_get_unique_axis(cell);
+			cc.profile_radius = crystal_get_profile_radius(cr);
+			crystal_get_det_shift(cr, &cc.shift_x, &cc.shift_y);
+			cc.first_refl = c->h.size();
+
+			RefListIterator *it;
+			RefList *list = crystal_get_reflections(cr);
+
+			for (Reflection *refl = first_refl(list, &it);
+			     refl != NULL; refl = next_refl(refl, it))
+			{
+				signed int a, b, d;
+				get_indices(refl, &a, &b, &d);
+				c->h.push_back(a); c->k.push_back(b); c->l.push_back(d);
+				get_symmetric_indices(refl, &a, &b, &d);
+				c->sh.push_back(a); c->sk.push_back(b); c->sl.push_back(d);
+
+				double fs, ss;
+				get_detector_pos(refl, &fs, &ss);
+				c->rint.push_back(get_intensity(refl));
+				c->rsig.push_back(get_esd_intensity(refl));
+				c->rpeak.push_back(get_peak(refl));
+				c->rbg.push_back(get_mean_bg(refl));
+				c->rfs.push_back(fs);
+				c->rss.push_back(ss);
+				c->rpanel.push_back(panel_index(_det, get_panel(refl)));
+			}
+
+			cc.n_refls = c->h.size() - cc.first_refl;
+			c->crys.push_back(cc);
+		}
+
+		c->ims.push_back(ci);
+	}
+}
+
+bool StreamCache::write()
+{
+	CacheColumns *c = _cols;
+
+	if (!sourceDetails())
+	{
+		return false;
+	}
+
+	CacheHeader head;
+	memset(&head, 0, sizeof(CacheHeader));
+	memcpy(head.magic, CACHE_MAGIC, 8);
+	head.version = CACHE_VERSION;
+	head.n_panels = _det->n_panels;
+	head.source_size = _size;
+	head.source_mtime = _mtime;
+	head.source_mtime_ns = _mtimeNs;
+	head.source_hash = _hash;
+	head.geom_hash = geometryHash();
+	head.max_adu = _maxADU;
+	head.n_images = c->ims.size();
+	head.n_peaks = c->pfs.size();
+	head.n_crystals = c->crys.size();
+	head.n_refls = c->h.size();
+	head.n_chars = c->chars.size();
+
+	/* write to the side and move into place, so a reader never sees
+	 * half a cache */
+	std::string tmp = _cacheFile + ".tmp";
+	FILE *fh = fopen(tmp.c_str(), "wb");
+	if (fh == NULL)
+	{
+		std::cout << "Cannot write stream cache " << _cacheFile
+		<< std::endl;
+		return false;
+	}
+
+	bool ok = write_block(fh, &head, sizeof(CacheHeader));
+	ok = ok && write_column(fh, c->ims);
+	ok = ok && write_column(fh, c->pfs) && write_column(fh, c->pss);
+	ok = ok && write_column(fh, c->pint) && write_column(fh, c->ppanel);
+	ok = ok && write_column(fh, c->pimage);
+	ok = ok && write_column(fh, c->crys);
+	ok = ok && write_column(fh, c->h) && write_column(fh, c->k);
+	ok = ok && write_column(fh, c->l) && write_column(fh, c->sh);
+	ok = ok && write_column(fh, c->sk) && write_column(fh, c->sl);
+	ok = ok && write_column(fh, c->rint) && write_column(fh, c->rsig);
+	ok = ok && write_column(fh, c->rpeak) && write_column(fh, c->rbg);
+	ok = ok && write_column(fh, c->rfs) && write_column(fh, c->rss);
+	ok = ok && write_column(fh, c->rpanel);
+	ok = ok && write_column(fh, c->chars);
+
+	ok = (fclose(fh) == 0) && ok;
+
+	if (!ok || rename(tmp.c_str(), _cacheFile.c_str()) != 0)
+	{
+		unlink(tmp.c_str());
+		return false;
+	}
+
+	std::cout << "Wrote stream cache " << _cacheFile << std::endl;
+
+	return true;
+}
+
+typedef struct
+{
+	const char *pos;
+	const char *end;
+	bool ok;
+} Reader;
+
+template <typename T>
+static const T *take(Reader *r, size_t n)
+{
+	size_t left = r->end - r->pos;
+	size_t bytes = pad8(n * sizeof(T));
+	if (!r->ok || n > left / sizeof(T) || left < bytes)
+	{
+		r->ok = false;
+		return NULL;
+	}
+
+	const T *ptr = (const T *)r->pos;
+	r->pos += bytes;
+
+	return ptr;
+}
+
+/* count entries from first lie within a column of total */
+static bool range_fits(uint64_t first, uint64_t count, uint64_t total)
+{
+	return (first <= total && count <= total - first);
+}
+
+/* a string starting at offset which ends before the character block */
+static bool string_fits(const char *chars, uint64_t n_chars, uint64_t offset)
+{
+	if (offset == NO_STRING)
+	{
+		return true;
+	}
+
+	return (offset < n_chars &&
+	        memchr(chars + offset, '\0', n_chars - offset) != NULL);
+}
+
+static bool panels_fit(const int32_t *panels, size_t n, uint32_t n_panels)
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		if (panels[i] >= (int64_t)n_panels)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Everything read() indexes with, checked against the columns it
+ * indexes into, since a damaged file can still match the stream. */
+static bool indices_fit(const CacheHeader *head, const CacheImage *ims,
+                        const CacheCrystal *crys, const int32_t *ppanel,
+                        const int32_t *rpanel, const char *chars)
+{
+	for (size_t i = 0; i < head->n_images; i++)
+	{
+		const CacheImage *ci = &ims[i];
+		uint64_t n_peaks = (ci->n_peaks > 0 ? ci->n_peaks : 0);
+
+		if (ci->n_peaks < -1 || ci->n_crystals < 0 ||
+		    !range_fits(ci->first_peak, n_peaks, head->n_peaks) ||
+		    !range_fits(ci->first_crystal, ci->n_crystals,
+		                head->n_crystals) ||
+		    !string_fits(chars, head->n_chars, ci->filename) ||
+		    !string_fits(chars, head->n_chars, ci->event))
+		{
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < head->n_crystals; i++)
+	{
+		if (!range_fits(crys[i].first_refl, crys[i].n_refls,
+		                head->n_refls))
+		{
+			return false;
+		}
+	}
+
+	return (panels_fit(ppanel, head->n_peaks, head->n_panels) &&
+	        panels_fit(rpanel, head->n_refls, head->n_panels));
+}
+
+bool StreamCache::read(std::vector<struct image> *dest, size_t threads)
+{
+	int fd = open(_cacheFile.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader))
+	{
+		close(fd);
+		return false;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+	{
+		return false;
+	}
+
+	Reader r = {(const char *)map, (const char *)map + st.st_size, true};
+	const CacheHeader *head = take<CacheHeader>(&r, 1);
+
+	bool valid = (memcmp(head->magic, CACHE_MAGIC, 8) == 0 &&
+	              head->version == CACHE_VERSION && sourceDetails() &&
+	              head->source_size == _size &&
+	              head->source_mtime == _mtime &&
+	              head->source_mtime_ns == _mtimeNs &&
+	              head->source_hash == _hash &&
+	              head->n_panels == (uint32_t)_det->n_panels &&
+	              head->geom_hash == geometryHash() &&
+	              (head->max_adu == _maxADU ||
+	               (isinf(head->max_adu) && isinf(_maxADU))));
+
+	if (!valid)
+	{
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	size_t np = head->n_peaks;
+	size_t nr = head->n_refls;
+
+	const CacheImage *ims = take<CacheImage>(&r, head->n_images);
+	const double *pfs = take<double>(&r, np);
+	const double *pss = take<double>(&r, np);
+	const double *pint = take<double>(&r, np);
+	const int32_t *ppanel = take<int32_t>(&r, np);
+	/* image ids are implied by first_peak when reading back */
+	take<uint32_t>(&r, np);
+	const CacheCrystal *crys = take<CacheCrystal>(&r, head->n_crystals);
+	const int32_t *h = take<int32_t>(&r, nr);
+	const int32_t *k = take<int32_t>(&r, nr);
+	const int32_t *l = take<int32_t>(&r, nr);
+	const int32_t *sh = take<int32_t>(&r, nr);
+	const int32_t *sk = take<int32_t>(&r, nr);
+	const int32_t *sl = take<int32_t>(&r, nr);
+	const double *rint = take<double>(&r, nr);
+	const double *rsig = take<double>(&r, nr);
+	const double *rpeak = take<double>(&r, nr);
+	const double *rbg = take<double>(&r, nr);
+	const double *rfs = take<double>(&r, nr);
+	const double *rss = take<double>(&r, nr);
+	const int32_t *rpanel = take<int32_t>(&r, nr);
+	const char *chars = take<char>(&r, head->n_chars);
+
+	if (!r.ok)
+	{
+		std::cout << "Stream cache " << _cacheFile << " is truncated."
+		<< std::endl;
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	if (!indices_fit(head, ims, crys, ppanel, rpanel, chars))
+	{
+		std::cout << "Stream cache " << _cacheFile << " is damaged."
+		<< std::endl;
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	struct detector *det = _det;
+	size_t start = dest->size();
+	size_t n_images = head->n_images;
+	dest->resize(start + n_images);
+
+	/* every image is independent, so rebuild them in parallel blocks */
+	size_t jobs = threads * 8;
+	if (jobs > n_images)
+	{
+		jobs = n_images;
+	}
+
+	run_jobs(jobs, threads, [&](size_t job)
+	{
+		size_t first = (n_images * job) / jobs;
+		size_t last = (n_images * (job + 1)) / jobs;
+
+		for (size_t i = first; i < last; i++)
+		{
+			const CacheImage *ci = &ims[i];
+			struct image *im = &dest->at(start + i);
+			memset(im, 0, sizeof(struct image));
+
+			im->det = det;
+			im->lambda = ci->lambda;
+			im->div = ci->div;
+			im->bw = ci->bw;
+			im->avg_clen = ci->avg_clen;
+			im->peak_resolution = ci->peak_resolution;
+			im->serial = ci->serial;
+
+			if (ci->filename != NO_STRING)
+			{
+				im->filename = strdup(&chars[ci->filename]);
+			}
+
+			if (ci->event != NO_STRING)
+			{
+				im->event = get_event_from_event_string(&chars[ci->event]);
+			}
+
+			if (ci->n_peaks >= 0)
+			{
+				im->features = image_feature_list_new();
+			}
+
+			for (int j = 0; j < ci->n_peaks; j++)
+			{
+				size_t n = ci->first_peak + j;
+				struct panel *p = NULL;
+				if (ppanel[n] >= 0)
+				{
+					p = &det->panels[ppanel[n]];
+				}
+
+				image_add_feature(im->features, pfs[n], pss[n], p, NULL,
+				                  pint[n], NULL);
+			}
+
+			im->n_crystals = ci->n_crystals;
+			if (ci->n_crystals > 0)
+			{
+				im->crystals = (Crystal **)malloc(ci->n_crystals *
+				                                  sizeof(Crystal *));
+			}
+
+			for (int j = 0; j < ci->n_crystals; j++)
+			{
+				const CacheCrystal *cc = &crys[ci->first_crystal + j];
+				const double *v = cc->recip;
+
+				UnitCell *cell = cell_new();
+				cell_set_reciprocal(cell, v[0], v[1], v[2], v[3], v[4],
+				                    v[5], v[6], v[7], v[8]);
+				cell_set_lattice_type(cell, (LatticeType)cc->lattice);
+				cell_set_centering(cell, cc->centering);
+				cell_set_unique_axis(cell, cc->unique_axis);
+
+				Crystal *cr = crystal_new();
+				crystal_set_cell(cr, cell);
+				crystal_set_profile_radius(cr, cc->profile_radius);
+				crystal_set_det_shift(cr, cc->shift_x, cc->shift_y);
+				crystal_set_user_flag(cr, 0);
+
+				RefList *list = reflist_new();
+				for (size_t m = cc->first_refl;
+				     m < cc->first_refl + cc->n_refls; m++)
+				{
+					Reflection *refl = add_refl(list, h[m], k[m], l[m]);
+					set_symmetric_indices(refl, sh[m], sk[m], sl[m]);
+					set_intensity(refl, rint[m]);
+					set_esd_intensity(refl, rsig[m]);
+					set_peak(refl, rpeak[m]);
+					set_mean_bg(refl, rbg[m]);
+					set_detector_pos(refl, rfs[m], rss[m]);
+					set_redundancy(refl, 1);
+
+					if (rpanel[m] >= 0)
+					{
+						set_panel(refl, &det->panels[rpanel[m]]);
+					}
+				}
+
+				crystal_set_reflections(cr, list);
+				im->crystals[j] = cr;
+			}
+		}
+	});
+
+	munmap(map, st.st_size);
+
+	std::cout << "Read " << n_images << " images from stream cache "
+	<< _cacheFile << std::endl;
+
+	return true;
+}
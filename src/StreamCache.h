@@ -0,0 +1,71 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __slipnslide__StreamCache__
+#define __slipnslide__StreamCache__
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <crystfel/detector.h>
+#include <crystfel/image.h>
+
+/* Binary sidecar for a stream which has already been through the loader,
+ * written next to it as <stream>.slipcache. Peaks and reflections are kept
+ * in columns with panel indices rather than names, and reflections are
+ * stored after the ADU cut and with asymmetric indices already applied.
+ * The cache is only trusted if the size, modification time and a hash of
+ * the head and tail of the stream still match, and the detector has the
+ * same panels as when it was written. Images are collected batch by
+ * batch as they are loaded, before anyone else can touch them, and the
+ * file is written once the whole stream has been seen. */
+
+struct CacheColumns;
+
+class StreamCache
+{
+public:
+	StreamCache(std::string streamFile, struct detector *det,
+	            double max_adu);
+	~StreamCache();
+
+	std::string cacheFilename()
+	{
+		return _cacheFile;
+	}
+
+	bool read(std::vector<struct image> *dest, size_t threads);
+	void collect(std::vector<struct image> *images);
+	bool write();
+private:
+	bool sourceDetails();
+	uint64_t geometryHash();
+
+	std::string _streamFile;
+	std::string _cacheFile;
+	struct detector *_det;
+	double _maxADU;
+	CacheColumns *_cols;
+
+	uint64_t _size;
+	int64_t _mtime;
+	int64_t _mtimeNs;
+	uint64_t _hash;
+};
+
+#endif
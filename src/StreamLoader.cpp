@@ -0,0 +1,397 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "StreamLoader.h"
+#include "MappedStream.h"
+#include "StreamCache.h"
+#include "thread_utils.h"
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+
+#include <crystfel/stream.h>
+#include <crystfel/utils.h>
+#include <crystfel/reflist.h>
+
+#define CHUNK_MARKER "----- Begin chunk -----"
+
+/* jobs handed out per thread, so that slow chunks even out */
+#define JOBS_PER_THREAD 8
+
+/* cap on chunks per job, so that the first batch arrives early */
+#define MAX_JOB_CHUNKS 1024
+
+StreamLoader::StreamLoader(std::string filename, struct detector *det)
+{
+	_filename = filename;
+	_det = det;
+	_threads = thread_count();
+	_maxADU = +INFINITY;
+	_mapped = new MappedStream(filename);
+	_useCache = true;
+	_handler = NULL;
+	_object = NULL;
+	_cancelled = false;
+	_loaded = 0;
+	_done = 0;
+	_skipped = 0;
+
+	const char *sym_str = "1";
+	pointgroup_warning(sym_str);
+	_sym = get_pointgroup(sym_str);
+}
+
+StreamLoader::~StreamLoader()
+{
+	free_symoplist(_sym);
+	delete _mapped;
+}
+
+bool StreamLoader::findChunks()
+{
+	_offsets.clear();
+
+	if (_mapped->isMapped())
+	{
+		_mapped->findChunks(&_offsets);
+		return true;
+	}
+
+	FILE *fh = fopen(_filename.c_str(), "r");
+	if (fh == NULL)
+	{
+		return false;
+	}
+
+	char *line = NULL;
+	size_t len = 0;
+	off_t pos = 0;
+	size_t marker = strlen(CHUNK_MARKER);
+
+	while (true)
+	{
+		ssize_t read = getline(&line, &len, fh);
+		if (read < 0)
+		{
+			break;
+		}
+
+		if (strncmp(line, CHUNK_MARKER, marker) == 0)
+		{
+			_offsets.push_back(pos);
+		}
+
+		pos += read;
+	}
+
+	free(line);
+	fclose(fh);
+
+	return true;
+}
+
+/* one pass over the list read by read_chunk, doing what apply_max_adu()
+ * followed by asymmetric_indices() used to do with an extra copy */
+static RefList *filter_reflections(RefList *list, double max_adu,
+                                   const SymOpList *sym)
+{
+	RefList *nlist;
+	Reflection *refl;
+	RefListIterator *iter;
+
+	nlist = reflist_new();
+	if ( nlist == NULL ) return NULL;
+
+	for ( refl = first_refl(list, &iter);
+	      refl != NULL;
+	      refl = next_refl(refl, iter) )
+	{
+		if ( !(get_peak(refl) < max_adu) ) continue;
+
+		signed int h, k, l;
+		signed int ha, ka, la;
+		get_indices(refl, &h, &k, &l);
+		get_asymm(sym, h, k, l, &ha, &ka, &la);
+
+		Reflection *nrefl = add_refl(nlist, ha, ka, la);
+		copy_data(nrefl, refl);
+		set_symmetric_indices(nrefl, h, k, l);
+	}
+
+	return nlist;
+}
+
+void StreamLoader::prepareCrystals(struct image *cur, bool filter)
+{
+	for (int i = 0; i < cur->n_crystals; i++)
+	{
+		Crystal *cr = cur->crystals[i];
+		crystal_set_user_flag(cr, 0);
+
+		if (!filter)
+		{
+			continue;
+		}
+
+		/* This is the raw list of reflections */
+		RefList *cr_refl = crystal_get_reflections(cr);
+		RefList *as = filter_reflections(cr_refl, _maxADU, _sym);
+		crystal_set_reflections(cr, as);
+		reflist_free(cr_refl);
+	}
+}
+
+/* a stream of its own, positioned at the start of a chunk */
+static Stream *open_stream_at(std::string filename, off_t offset)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+
+	if (lseek(fd, offset, SEEK_SET) < 0)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	/* takes ownership of fd */
+	Stream *stream = open_stream_fd_for_read(fd);
+	if (stream == NULL)
+	{
+		close(fd);
+	}
+
+	return stream;
+}
+
+bool StreamLoader::loadRange(size_t start, size_t end,
+                             std::vector<struct image> *dest)
+{
+	Stream *stream = open_stream_at(_filename, _offsets[start]);
+	if (stream == NULL)
+	{
+		_skipped += end - start;
+		return false;
+	}
+
+	bool success = true;
+	dest->reserve(end - start);
+
+	for (size_t i = start; i < end && !_cancelled; i++)
+	{
+		struct image next;
+		memset(&next, 0, sizeof(struct image));
+		next.det = _det;
+		next.div = NAN;
+		next.bw = NAN;
+
+		if (read_chunk(stream, &next) == 0)
+		{
+			prepareCrystals(&next, true);
+			dest->push_back(next);
+			_done++;
+			continue;
+		}
+
+		/* only this chunk is lost, but read_chunk may have stopped
+		 * anywhere in it, so pick up again at the next marker */
+		Session::freeImage(&next);
+		_skipped++;
+		success = false;
+		close_stream(stream);
+		stream = NULL;
+
+		if (i + 1 < end)
+		{
+			stream = open_stream_at(_filename, _offsets[i + 1]);
+		}
+
+		if (stream == NULL)
+		{
+			_skipped += end - i - 1;
+			return false;
+		}
+	}
+
+	close_stream(stream);
+
+	return success;
+}
+
+bool StreamLoader::mapRange(size_t start, size_t end,
+                            std::vector<struct image> *dest)
+{
+	bool success = true;
+	dest->reserve(end - start);
+
+	for (size_t i = start; i < end && !_cancelled; i++)
+	{
+		struct image next;
+		memset(&next, 0, sizeof(struct image));
+		next.det = _det;
+		next.div = NAN;
+		next.bw = NAN;
+
+		if (!_mapped->readChunk(_offsets[i], &next))
+		{
+			/* only this chunk is lost; the rest are still read */
+			Session::freeImage(&next);
+			_skipped++;
+			success = false;
+			continue;
+		}
+
+		/* already filtered while parsing */
+		prepareCrystals(&next, false);
+		dest->push_back(next);
+		_done++;
+	}
+
+	return success;
+}
+
+void StreamLoader::handOff(std::vector<struct image> *batch,
+                           Session *dest)
+{
+	_loaded += batch->size();
+
+	if (_handler != NULL)
+	{
+		_handler(_object, batch);
+	}
+	else
+	{
+		dest->addImages(batch);
+	}
+
+	std::vector<struct image>().swap(*batch);
+}
+
+bool StreamLoader::load(Session *dest)
+{
+	StreamCache cache(_filename, _det, _maxADU);
+	std::vector<struct image> cached;
+	_cancelled = false;
+	_loaded = 0;
+	_done = 0;
+	_skipped = 0;
+
+	if (_useCache && cache.read(&cached, _threads))
+	{
+		_done = cached.size();
+		handOff(&cached, dest);
+		return true;
+	}
+
+	_mapped->setFilter(_maxADU, _sym);
+
+	if (_offsets.size() == 0 && !findChunks())
+	{
+		return false;
+	}
+
+	size_t total = _offsets.size();
+	size_t jobs = _threads * JOBS_PER_THREAD;
+	if (jobs < total / MAX_JOB_CHUNKS)
+	{
+		jobs = total / MAX_JOB_CHUNKS;
+	}
+
+	if (jobs > total)
+	{
+		jobs = total;
+	}
+
+	if (_handler == NULL)
+	{
+		dest->reserve(dest->imageCount() + total);
+	}
+
+	std::vector<std::vector<struct image> > results;
+	results.resize(jobs);
+	std::vector<int> finished(jobs, 0);
+	size_t next = 0;
+	std::mutex order;
+	bool failed = false;
+
+	run_jobs(jobs, _threads, [&](size_t job)
+	{
+		size_t start = (total * job) / jobs;
+		size_t end = (total * (job + 1)) / jobs;
+		bool success = true;
+
+		if (_cancelled)
+		{
+			return;
+		}
+		else if (_mapped->canParse())
+		{
+			success = mapRange(start, end, &results[job]);
+		}
+		else
+		{
+			success = loadRange(start, end, &results[job]);
+		}
+
+		/* hand batches on strictly in file order, as soon as every
+		 * earlier batch has gone too */
+		std::lock_guard<std::mutex> lock(order);
+		finished[job] = 1;
+		failed |= !success;
+
+		while (next < jobs && finished[next] && !_cancelled)
+		{
+			if (_useCache)
+			{
+				cache.collect(&results[next]);
+			}
+
+			handOff(&results[next], dest);
+			next++;
+		}
+	});
+
+	if (_cancelled)
+	{
+		std::cout << "Cancelled loading after " << _loaded << " images."
+		<< std::endl;
+		return false;
+	}
+
+	std::cout << "Loaded " << _loaded << " images from " << total
+	<< " chunks on " << _threads << " threads." << std::endl;
+
+	/* a partial set is neither cached nor passed off as the stream */
+	if (failed)
+	{
+		ERROR("Failed to read %zu of %zu chunks in stream %s.\n",
+		      (size_t)_skipped, total, _filename.c_str());
+		return false;
+	}
+
+	if (_useCache)
+	{
+		cache.write();
+	}
+
+	return true;
+}
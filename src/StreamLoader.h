@@ -0,0 +1,122 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __slipnslide__StreamLoader__
+#define __slipnslide__StreamLoader__
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <crystfel/detector.h>
+#include <crystfel/image.h>
+#include <crystfel/symmetry.h>
+#include "Session.h"
+
+class MappedStream;
+
+typedef void (*BatchHandler)(void *object, std::vector<struct image> *batch);
+
+/* Reads a CrystFEL stream by first finding every "Begin chunk" marker,
+ * then handing ranges of chunks to worker threads which each parse their
+ * own share through a separate file descriptor. Images come back in the
+ * order they appear in the file, whatever the number of threads.
+ * Where the stream can be memory-mapped, chunks are parsed straight from
+ * the map by MappedStream; otherwise each worker goes through read_chunk.
+ * Finished images are handed on in batches, in file order, either to
+ * the destination session or to a batch handler, which is called from
+ * a worker thread and must take its own copy of the batch. */
+
+class StreamLoader
+{
+public:
+	StreamLoader(std::string filename, struct detector *det);
+	~StreamLoader();
+
+	void setThreads(size_t threads)
+	{
+		_threads = threads;
+	}
+
+	void setMaxADU(double max_adu)
+	{
+		_maxADU = max_adu;
+	}
+
+	/* read from and write to a binary sidecar next to the stream */
+	void setUseCache(bool use)
+	{
+		_useCache = use;
+	}
+
+	void setBatchHandler(BatchHandler handler, void *object)
+	{
+		_handler = handler;
+		_object = object;
+	}
+
+	size_t chunkCount()
+	{
+		return _offsets.size();
+	}
+
+	size_t chunksRead()
+	{
+		return _done;
+	}
+
+	/* chunks which couldn't be parsed and were left out */
+	size_t chunksSkipped()
+	{
+		return _skipped;
+	}
+
+	/* safe to call from any thread; load() returns false soon after */
+	void cancel()
+	{
+		_cancelled = true;
+	}
+
+	bool findChunks();
+	bool load(Session *dest);
+private:
+	bool loadRange(size_t start, size_t end,
+	               std::vector<struct image> *dest);
+	bool mapRange(size_t start, size_t end,
+	              std::vector<struct image> *dest);
+	void handOff(std::vector<struct image> *batch, Session *dest);
+	void prepareCrystals(struct image *im, bool filter);
+
+	std::string _filename;
+	struct detector *_det;
+	MappedStream *_mapped;
+	std::vector<off_t> _offsets;
+	size_t _threads;
+	double _maxADU;
+	bool _useCache;
+	BatchHandler _handler;
+	void *_object;
+	std::atomic<bool> _cancelled;
+	std::atomic<size_t> _done;
+	std::atomic<size_t> _skipped;
+	size_t _loaded;
+	SymOpList *_sym;
+};
+
+#endif
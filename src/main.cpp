@@ -19,11 +19,21 @@
 #include <crystfel/detector.h>
 #include <crystfel/stream.h>
 #include "Overview.h"
+#include "Headless.h"
 #include <iostream>
 #include <QApplication>
 
 int main(int argc, char *argv[])
 {
+	setlocale(LC_NUMERIC, "C");
+
+	/* no window, no OpenGL: load, refine, write and exit */
+	if (Headless::requested(argc, argv))
+	{
+		Headless headless(argc, argv);
+		return headless.run();
+	}
+
 	std::cout << "Qt version: " << qVersion() << std::endl;
 
 	QApplication app(argc, argv);
@@ -0,0 +1,703 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#include "predict_kernel.h"
+#include <math.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+static void predict_scalar(const int *h, const int *k, const int *l,
+                           size_t n, const double *cell, double knom,
+                           double *x, double *y, double *z,
+                           double *u, double *v)
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		double xl = h[i]*cell[0] + k[i]*cell[3] + l[i]*cell[6];
+		double yl = h[i]*cell[1] + k[i]*cell[4] + l[i]*cell[7];
+		double zl = h[i]*cell[2] + k[i]*cell[5] + l[i]*cell[8];
+		double w = knom + zl;
+
+		x[i] = xl;
+		y[i] = yl;
+		z[i] = zl;
+		u[i] = xl / w;
+		v[i] = yl / w;
+	}
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("avx2,fma")))
+static void predict_avx2(const int *h, const int *k, const int *l,
+                         size_t n, const double *cell, double knom,
+                         double *x, double *y, double *z,
+                         double *u, double *v)
+{
+	__m256d c[9];
+	for (int j = 0; j < 9; j++)
+	{
+		c[j] = _mm256_set1_pd(cell[j]);
+	}
+
+	__m256d kn = _mm256_set1_pd(knom);
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i hi = _mm_loadu_si128((__m128i *)(h + i));
+		__m128i ki = _mm_loadu_si128((__m128i *)(k + i));
+		__m128i li = _mm_loadu_si128((__m128i *)(l + i));
+		__m256d hd = _mm256_cvtepi32_pd(hi);
+		__m256d kd = _mm256_cvtepi32_pd(ki);
+		__m256d ld = _mm256_cvtepi32_pd(li);
+
+		__m256d xl = _mm256_mul_pd(hd, c[0]);
+		xl = _mm256_fmadd_pd(kd, c[3], xl);
+		xl = _mm256_fmadd_pd(ld, c[6], xl);
+		__m256d yl = _mm256_mul_pd(hd, c[1]);
+		yl = _mm256_fmadd_pd(kd, c[4], yl);
+		yl = _mm256_fmadd_pd(ld, c[7], yl);
+		__m256d zl = _mm256_mul_pd(hd, c[2]);
+		zl = _mm256_fmadd_pd(kd, c[5], zl);
+		zl = _mm256_fmadd_pd(ld, c[8], zl);
+		__m256d w = _mm256_add_pd(kn, zl);
+
+		_mm256_storeu_pd(x + i, xl);
+		_mm256_storeu_pd(y + i, yl);
+		_mm256_storeu_pd(z + i, zl);
+		_mm256_storeu_pd(u + i, _mm256_div_pd(xl, w));
+		_mm256_storeu_pd(v + i, _mm256_div_pd(yl, w));
+	}
+
+	predict_scalar(h + i, k + i, l + i, n - i, cell, knom,
+	               x + i, y + i, z + i, u + i, v + i);
+}
+
+__attribute__((target("avx512f")))
+static void predict_avx512(const int *h, const int *k, const int *l,
+                           size_t n, const double *cell, double knom,
+                           double *x, double *y, double *z,
+                           double *u, double *v)
+{
+	__m512d c[9];
+	for (int j = 0; j < 9; j++)
+	{
+		c[j] = _mm512_set1_pd(cell[j]);
+	}
+
+	__m512d kn = _mm512_set1_pd(knom);
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i hi = _mm256_loadu_si256((__m256i *)(h + i));
+		__m256i ki = _mm256_loadu_si256((__m256i *)(k + i));
+		__m256i li = _mm256_loadu_si256((__m256i *)(l + i));
+		__m512d hd = _mm512_maskz_cvtepi32_pd(0xff, hi);
+		__m512d kd = _mm512_maskz_cvtepi32_pd(0xff, ki);
+		__m512d ld = _mm512_maskz_cvtepi32_pd(0xff, li);
+
+		__m512d xl = _mm512_mul_pd(hd, c[0]);
+		xl = _mm512_fmadd_pd(kd, c[3], xl);
+		xl = _mm512_fmadd_pd(ld, c[6], xl);
+		__m512d yl = _mm512_mul_pd(hd, c[1]);
+		yl = _mm512_fmadd_pd(kd, c[4], yl);
+		yl = _mm512_fmadd_pd(ld, c[7], yl);
+		__m512d zl = _mm512_mul_pd(hd, c[2]);
+		zl = _mm512_fmadd_pd(kd, c[5], zl);
+		zl = _mm512_fmadd_pd(ld, c[8], zl);
+		__m512d w = _mm512_add_pd(kn, zl);
+
+		_mm512_storeu_pd(x + i, xl);
+		_mm512_storeu_pd(y + i, yl);
+		_mm512_storeu_pd(z + i, zl);
+		_mm512_storeu_pd(u + i, _mm512_div_pd(xl, w));
+		_mm512_storeu_pd(v + i, _mm512_div_pd(yl, w));
+	}
+
+	predict_scalar(h + i, k + i, l + i, n - i, cell, knom,
+	               x + i, y + i, z + i, u + i, v + i);
+}
+
+#endif
+
+/* lab frame position of each pixel from its panel's affine map, scaled
+ * onto the Ewald sphere of radius k and shifted to its centre */
+static void reciprocal_scalar(const double *coeffs, const int *panels,
+                              const double *fs, const double *ss,
+                              const double *k, size_t n,
+                              double *rx, double *ry, double *rz)
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		const double *c = &coeffs[panels[i] * PANEL_COEFFS];
+		double x = c[0] * fs[i] + c[1] * ss[i] + c[2];
+		double y = c[3] * fs[i] + c[4] * ss[i] + c[5];
+		double z = c[6] * fs[i] + c[7] * ss[i] + c[8];
+		double scale = k[i] / sqrt(x * x + y * y + z * z);
+
+		rx[i] = x * scale;
+		ry[i] = y * scale;
+		rz[i] = z * scale - k[i];
+	}
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("avx2,fma")))
+static void reciprocal_avx2(const double *coeffs, const int *panels,
+                            const double *fs, const double *ss,
+                            const double *k, size_t n,
+                            double *rx, double *ry, double *rz)
+{
+	__m128i stride = _mm_set1_epi32(PANEL_COEFFS);
+	/* masked gathers, as the unmasked ones start from undefined */
+	__m256d zero = _mm256_setzero_pd();
+	__m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i pi = _mm_loadu_si128((__m128i *)(panels + i));
+		__m128i base = _mm_mullo_epi32(pi, stride);
+		__m256d f = _mm256_loadu_pd(fs + i);
+		__m256d s = _mm256_loadu_pd(ss + i);
+		__m256d xyz[3];
+
+		for (int j = 0; j < 3; j++)
+		{
+			__m128i idx = _mm_add_epi32(base, _mm_set1_epi32(j * 3));
+			__m256d a = _mm256_mask_i32gather_pd(zero, coeffs, idx,
+			                                     all, 8);
+			idx = _mm_add_epi32(idx, _mm_set1_epi32(1));
+			__m256d b = _mm256_mask_i32gather_pd(zero, coeffs, idx,
+			                                     all, 8);
+			idx = _mm_add_epi32(idx, _mm_set1_epi32(1));
+			__m256d c = _mm256_mask_i32gather_pd(zero, coeffs, idx,
+			                                     all, 8);
+
+			xyz[j] = _mm256_fmadd_pd(a, f, _mm256_fmadd_pd(b, s, c));
+		}
+
+		__m256d len = _mm256_mul_pd(xyz[0], xyz[0]);
+		len = _mm256_fmadd_pd(xyz[1], xyz[1], len);
+		len = _mm256_fmadd_pd(xyz[2], xyz[2], len);
+		__m256d kk = _mm256_loadu_pd(k + i);
+		__m256d scale = _mm256_div_pd(kk, _mm256_sqrt_pd(len));
+
+		_mm256_storeu_pd(rx + i, _mm256_mul_pd(xyz[0], scale));
+		_mm256_storeu_pd(ry + i, _mm256_mul_pd(xyz[1], scale));
+		_mm256_storeu_pd(rz + i, _mm256_fmsub_pd(xyz[2], scale, kk));
+	}
+
+	reciprocal_scalar(coeffs, panels + i, fs + i, ss + i, k + i, n - i,
+	                  rx + i, ry + i, rz + i);
+}
+
+__attribute__((target("avx512f")))
+static void reciprocal_avx512(const double *coeffs, const int *panels,
+                              const double *fs, const double *ss,
+                              const double *k, size_t n,
+                              double *rx, double *ry, double *rz)
+{
+	__m256i stride = _mm256_set1_epi32(PANEL_COEFFS);
+	__m512d zero = _mm512_setzero_pd();
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i pi = _mm256_loadu_si256((__m256i *)(panels + i));
+		__m256i base = _mm256_mullo_epi32(pi, stride);
+		__m512d f = _mm512_loadu_pd(fs + i);
+		__m512d s = _mm512_loadu_pd(ss + i);
+		__m512d xyz[3];
+
+		for (int j = 0; j < 3; j++)
+		{
+			__m256i idx = _mm256_add_epi32(base, _mm256_set1_epi32(j * 3));
+			__m512d a = _mm512_mask_i32gather_pd(zero, 0xff, idx,
+			                                     coeffs, 8);
+			idx = _mm256_add_epi32(idx, _mm256_set1_epi32(1));
+			__m512d b = _mm512_mask_i32gather_pd(zero, 0xff, idx,
+			                                     coeffs, 8);
+			idx = _mm256_add_epi32(idx, _mm256_set1_epi32(1));
+			__m512d c = _mm512_mask_i32gather_pd(zero, 0xff, idx,
+			                                     coeffs, 8);
+
+			xyz[j] = _mm512_fmadd_pd(a, f, _mm512_fmadd_pd(b, s, c));
+		}
+
+		__m512d len = _mm512_mul_pd(xyz[0], xyz[0]);
+		len = _mm512_fmadd_pd(xyz[1], xyz[1], len);
+		len = _mm512_fmadd_pd(xyz[2], xyz[2], len);
+		__m512d kk = _mm512_loadu_pd(k + i);
+		__m512d scale = _mm512_div_pd(kk, _mm512_maskz_sqrt_pd(0xff, len));
+
+		_mm512_storeu_pd(rx + i, _mm512_mul_pd(xyz[0], scale));
+		_mm512_storeu_pd(ry + i, _mm512_mul_pd(xyz[1], scale));
+		_mm512_storeu_pd(rz + i, _mm512_fmsub_pd(xyz[2], scale, kk));
+	}
+
+	reciprocal_scalar(coeffs, panels + i, fs + i, ss + i, k + i, n - i,
+	                  rx + i, ry + i, rz + i);
+}
+
+#endif
+
+/* where each ray (x, y, k + z) crosses the plane of its panel, and
+ * whether that is on the panel, in the same order of operations as
+ * Predictor's one ray at a time, so that every version below agrees
+ * with it to the bit: no fused multiply-adds, and NaN counts as on */
+static void rays_scalar(const double *coeffs, const int *panels,
+                        const double *x, const double *y, const double *z,
+                        const double *k, size_t n,
+                        double *fs, double *ss, char *hit)
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		const double *m = &coeffs[panels[i] * RAY_COEFFS];
+		double t0 = x[i];
+		double t1 = y[i];
+		double t2 = k[i] + z[i];
+
+		double one_over_mu = m[0] * t0 + m[1] * t1 + m[2] * t2;
+		double f = (m[3] * t0 + m[4] * t1 + m[5] * t2) / one_over_mu;
+		double s = (m[6] * t0 + m[7] * t1 + m[8] * t2) / one_over_mu;
+
+		fs[i] = f;
+		ss[i] = s;
+		hit[i] = !(f < 0 || f >= m[9] || s < 0 || s >= m[10]);
+	}
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* no fma in the target, so the multiplies and adds can't be fused */
+__attribute__((target("avx2")))
+static void rays_avx2(const double *coeffs, const int *panels,
+                      const double *x, const double *y, const double *z,
+                      const double *k, size_t n,
+                      double *fs, double *ss, char *hit)
+{
+	__m128i stride = _mm_set1_epi32(RAY_COEFFS);
+	__m128i one = _mm_set1_epi32(1);
+	__m256d zero = _mm256_setzero_pd();
+	__m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i pi = _mm_loadu_si128((__m128i *)(panels + i));
+		__m128i idx = _mm_mullo_epi32(pi, stride);
+		__m256d m[RAY_COEFFS];
+
+		for (int j = 0; j < RAY_COEFFS; j++)
+		{
+			m[j] = _mm256_mask_i32gather_pd(zero, coeffs, idx, all, 8);
+			idx = _mm_add_epi32(idx, one);
+		}
+
+		__m256d t0 = _mm256_loadu_pd(x + i);
+		__m256d t1 = _mm256_loadu_pd(y + i);
+		__m256d t2 = _mm256_add_pd(_mm256_loadu_pd(k + i),
+		                           _mm256_loadu_pd(z + i));
+		__m256d row[3];
+
+		for (int j = 0; j < 3; j++)
+		{
+			__m256d sum = _mm256_mul_pd(m[j * 3], t0);
+			sum = _mm256_add_pd(sum, _mm256_mul_pd(m[j * 3 + 1], t1));
+			row[j] = _mm256_add_pd(sum, _mm256_mul_pd(m[j * 3 + 2], t2));
+		}
+
+		__m256d f = _mm256_div_pd(row[1], row[0]);
+		__m256d s = _mm256_div_pd(row[2], row[0]);
+
+		/* the negated comparisons are true for NaN */
+		__m256d on = _mm256_cmp_pd(f, zero, _CMP_NLT_UQ);
+		on = _mm256_and_pd(on, _mm256_cmp_pd(f, m[9], _CMP_NGE_UQ));
+		on = _mm256_and_pd(on, _mm256_cmp_pd(s, zero, _CMP_NLT_UQ));
+		on = _mm256_and_pd(on, _mm256_cmp_pd(s, m[10], _CMP_NGE_UQ));
+		int bits = _mm256_movemask_pd(on);
+
+		_mm256_storeu_pd(fs + i, f);
+		_mm256_storeu_pd(ss + i, s);
+
+		for (int j = 0; j < 4; j++)
+		{
+			hit[i + j] = (bits >> j) & 1;
+		}
+	}
+
+	rays_scalar(coeffs, panels + i, x + i, y + i, z + i, k + i, n - i,
+	            fs + i, ss + i, hit + i);
+}
+
+/* AVX-512F has fused multiply-adds of its own, so contraction is turned
+ * off by hand */
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static void rays_avx512(const double *coeffs, const int *panels,
+                        const double *x, const double *y, const double *z,
+                        const double *k, size_t n,
+                        double *fs, double *ss, char *hit)
+{
+	__m256i stride = _mm256_set1_epi32(RAY_COEFFS);
+	__m256i one = _mm256_set1_epi32(1);
+	__m512d zero = _mm512_setzero_pd();
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i pi = _mm256_loadu_si256((__m256i *)(panels + i));
+		__m256i idx = _mm256_mullo_epi32(pi, stride);
+		__m512d m[RAY_COEFFS];
+
+		for (int j = 0; j < RAY_COEFFS; j++)
+		{
+			m[j] = _mm512_mask_i32gather_pd(zero, 0xff, idx, coeffs, 8);
+			idx = _mm256_add_epi32(idx, one);
+		}
+
+		__m512d t0 = _mm512_loadu_pd(x + i);
+		__m512d t1 = _mm512_loadu_pd(y + i);
+		__m512d t2 = _mm512_add_pd(_mm512_loadu_pd(k + i),
+		                           _mm512_loadu_pd(z + i));
+		__m512d row[3];
+
+		for (int j = 0; j < 3; j++)
+		{
+			__m512d sum = _mm512_mul_pd(m[j * 3], t0);
+			sum = _mm512_add_pd(sum, _mm512_mul_pd(m[j * 3 + 1], t1));
+			row[j] = _mm512_add_pd(sum, _mm512_mul_pd(m[j * 3 + 2], t2));
+		}
+
+		__m512d f = _mm512_div_pd(row[1], row[0]);
+		__m512d s = _mm512_div_pd(row[2], row[0]);
+
+		__mmask8 on = _mm512_cmp_pd_mask(f, zero, _CMP_NLT_UQ);
+		on &= _mm512_cmp_pd_mask(f, m[9], _CMP_NGE_UQ);
+		on &= _mm512_cmp_pd_mask(s, zero, _CMP_NLT_UQ);
+		on &= _mm512_cmp_pd_mask(s, m[10], _CMP_NGE_UQ);
+
+		_mm512_storeu_pd(fs + i, f);
+		_mm512_storeu_pd(ss + i, s);
+
+		for (int j = 0; j < 8; j++)
+		{
+			hit[i + j] = (on >> j) & 1;
+		}
+	}
+
+	rays_scalar(coeffs, panels + i, x + i, y + i, z + i, k + i, n - i,
+	            fs + i, ss + i, hit + i);
+}
+
+#endif
+
+/* exp(t) for t <= 0, the same to the last bit whichever of the versions
+ * below is used: t = n ln 2 + r with |r| <= ln 2 / 2, then a degree 11
+ * Taylor polynomial in r, good to a few parts in 1e15. Anything below
+ * EXP_FLOOR, and NaN, comes out as next to nothing. */
+#define EXP_FLOOR (-708.0)
+#define LN2_HI (6.93147180369123816490e-01)
+#define LN2_LO (1.90821492927058770002e-10)
+
+static const double exp_coeffs[] =
+{
+	1.0 / 39916800, 1.0 / 3628800, 1.0 / 362880, 1.0 / 40320,
+	1.0 / 5040, 1.0 / 720, 1.0 / 120, 1.0 / 24, 1.0 / 6, 0.5, 1.0, 1.0
+};
+
+static inline double exp_scalar(double t)
+{
+	t = fmax(t, EXP_FLOOR);
+	double n = nearbyint(t * M_LOG2E);
+	double r = fma(-n, LN2_HI, t);
+	r = fma(-n, LN2_LO, r);
+
+	double p = exp_coeffs[0];
+	for (int j = 1; j < 12; j++)
+	{
+		p = fma(p, r, exp_coeffs[j]);
+	}
+
+	return ldexp(p, (int)n);
+}
+
+static void gaussian_scalar(const double *x, const double *y, size_t n,
+                            double scale, double *lanes)
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		/* rounded once, as by the fused multiply-add below */
+		double d = fma(y[i], y[i], x[i] * x[i]);
+		lanes[i % GAUSSIAN_LANES] += exp_scalar(-scale * d);
+	}
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* 2^n for whole n from -1022 up, by putting n + 1023 in the exponent */
+#define EXP_SHIFTER (6755399441055744.0 + 1023)
+
+__attribute__((target("avx2,fma")))
+static inline __m256d exp_avx2(__m256d t)
+{
+	t = _mm256_max_pd(t, _mm256_set1_pd(EXP_FLOOR));
+	__m256d n = _mm256_mul_pd(t, _mm256_set1_pd(M_LOG2E));
+	n = _mm256_round_pd(n, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	__m256d r = _mm256_fnmadd_pd(n, _mm256_set1_pd(LN2_HI), t);
+	r = _mm256_fnmadd_pd(n, _mm256_set1_pd(LN2_LO), r);
+
+	__m256d p = _mm256_set1_pd(exp_coeffs[0]);
+	for (int j = 1; j < 12; j++)
+	{
+		p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(exp_coeffs[j]));
+	}
+
+	__m256d bits = _mm256_add_pd(n, _mm256_set1_pd(EXP_SHIFTER));
+	__m256i e = _mm256_slli_epi64(_mm256_castpd_si256(bits), 52);
+
+	return _mm256_mul_pd(p, _mm256_castsi256_pd(e));
+}
+
+__attribute__((target("avx2,fma")))
+static void gaussian_avx2(const double *x, const double *y, size_t n,
+                          double scale, double *lanes)
+{
+	__m256d neg = _mm256_set1_pd(-scale);
+	__m256d lo = _mm256_loadu_pd(lanes);
+	__m256d hi = _mm256_loadu_pd(lanes + 4);
+	size_t i = 0;
+
+	for (; i + GAUSSIAN_LANES <= n; i += GAUSSIAN_LANES)
+	{
+		for (int half = 0; half < 2; half++)
+		{
+			__m256d xv = _mm256_loadu_pd(x + i + half * 4);
+			__m256d yv = _mm256_loadu_pd(y + i + half * 4);
+			__m256d d = _mm256_mul_pd(xv, xv);
+			d = _mm256_fmadd_pd(yv, yv, d);
+			__m256d e = exp_avx2(_mm256_mul_pd(neg, d));
+
+			if (half == 0)
+			{
+				lo = _mm256_add_pd(lo, e);
+			}
+			else
+			{
+				hi = _mm256_add_pd(hi, e);
+			}
+		}
+	}
+
+	_mm256_storeu_pd(lanes, lo);
+	_mm256_storeu_pd(lanes + 4, hi);
+	gaussian_scalar(x + i, y + i, n - i, scale, lanes);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512d exp_avx512(__m512d t)
+{
+	t = _mm512_maskz_max_pd(0xff, t, _mm512_set1_pd(EXP_FLOOR));
+	__m512d n = _mm512_mul_pd(t, _mm512_set1_pd(M_LOG2E));
+	n = _mm512_maskz_roundscale_pd(0xff, n, _MM_FROUND_TO_NEAREST_INT);
+	__m512d r = _mm512_fnmadd_pd(n, _mm512_set1_pd(LN2_HI), t);
+	r = _mm512_fnmadd_pd(n, _mm512_set1_pd(LN2_LO), r);
+
+	__m512d p = _mm512_set1_pd(exp_coeffs[0]);
+	for (int j = 1; j < 12; j++)
+	{
+		p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(exp_coeffs[j]));
+	}
+
+	__m512d bits = _mm512_add_pd(n, _mm512_set1_pd(EXP_SHIFTER));
+	__m512i e = _mm512_maskz_slli_epi64(0xff, _mm512_castpd_si512(bits),
+	                                     52);
+
+	return _mm512_mul_pd(p, _mm512_castsi512_pd(e));
+}
+
+__attribute__((target("avx512f")))
+static void gaussian_avx512(const double *x, const double *y, size_t n,
+                            double scale, double *lanes)
+{
+	__m512d neg = _mm512_set1_pd(-scale);
+	__m512d acc = _mm512_loadu_pd(lanes);
+	size_t i = 0;
+
+	for (; i + GAUSSIAN_LANES <= n; i += GAUSSIAN_LANES)
+	{
+		__m512d xv = _mm512_loadu_pd(x + i);
+		__m512d yv = _mm512_loadu_pd(y + i);
+		__m512d d = _mm512_mul_pd(xv, xv);
+		d = _mm512_fmadd_pd(yv, yv, d);
+		acc = _mm512_add_pd(acc, exp_avx512(_mm512_mul_pd(neg, d)));
+	}
+
+	_mm512_storeu_pd(lanes, acc);
+	gaussian_scalar(x + i, y + i, n - i, scale, lanes);
+}
+
+#endif
+
+typedef enum
+{
+	SimdNone,
+	SimdAVX2,
+	SimdAVX512,
+} SimdLevel;
+
+static SimdLevel choose_level()
+{
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f"))
+	{
+		return SimdAVX512;
+	}
+
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	{
+		return SimdAVX2;
+	}
+#endif
+
+	return SimdNone;
+}
+
+static SimdLevel simd_level()
+{
+	static SimdLevel level = choose_level();
+	return level;
+}
+
+void predict_lattice(const int *h, const int *k, const int *l, size_t n,
+                     const double *cell, double knom,
+                     double *x, double *y, double *z,
+                     double *u, double *v)
+{
+	switch (simd_level())
+	{
+#ifdef HAVE_X86_KERNELS
+		case SimdAVX512:
+		predict_avx512(h, k, l, n, cell, knom, x, y, z, u, v);
+		break;
+
+		case SimdAVX2:
+		predict_avx2(h, k, l, n, cell, knom, x, y, z, u, v);
+		break;
+#endif
+
+		default:
+		predict_scalar(h, k, l, n, cell, knom, x, y, z, u, v);
+		break;
+	}
+}
+
+void pixels_to_reciprocal(const double *coeffs, const int *panels,
+                          const double *fs, const double *ss,
+                          const double *k, size_t n,
+                          double *rx, double *ry, double *rz)
+{
+	switch (simd_level())
+	{
+#ifdef HAVE_X86_KERNELS
+		case SimdAVX512:
+		reciprocal_avx512(coeffs, panels, fs, ss, k, n, rx, ry, rz);
+		break;
+
+		case SimdAVX2:
+		reciprocal_avx2(coeffs, panels, fs, ss, k, n, rx, ry, rz);
+		break;
+#endif
+
+		default:
+		reciprocal_scalar(coeffs, panels, fs, ss, k, n, rx, ry, rz);
+		break;
+	}
+}
+
+void rays_to_panels(const double *coeffs, const int *panels,
+                    const double *x, const double *y, const double *z,
+                    const double *k, size_t n,
+                    double *fs, double *ss, char *hit)
+{
+	switch (simd_level())
+	{
+#ifdef HAVE_X86_KERNELS
+		case SimdAVX512:
+		rays_avx512(coeffs, panels, x, y, z, k, n, fs, ss, hit);
+		break;
+
+		case SimdAVX2:
+		rays_avx2(coeffs, panels, x, y, z, k, n, fs, ss, hit);
+		break;
+#endif
+
+		default:
+		rays_scalar(coeffs, panels, x, y, z, k, n, fs, ss, hit);
+		break;
+	}
+}
+
+double gaussian_sum(const double *x, const double *y, size_t n,
+                    double scale)
+{
+	double lanes[GAUSSIAN_LANES] = {0};
+
+	switch (simd_level())
+	{
+#ifdef HAVE_X86_KERNELS
+		case SimdAVX512:
+		gaussian_avx512(x, y, n, scale, lanes);
+		break;
+
+		case SimdAVX2:
+		gaussian_avx2(x, y, n, scale, lanes);
+		break;
+#endif
+
+		default:
+		gaussian_scalar(x, y, n, scale, lanes);
+		break;
+	}
+
+	return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+	       ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+}
+
+const char *predict_kernel_name()
+{
+	switch (simd_level())
+	{
+		case SimdAVX512:
+		return "AVX-512";
+
+		case SimdAVX2:
+		return "AVX2";
+
+		default:
+		return "scalar";
+	}
+}
@@ -0,0 +1,77 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __slipnslide__predict_kernel__
+#define __slipnslide__predict_kernel__
+
+#include <stddef.h>
+
+/* Kernels for the hot loops of prediction and scoring. Each uses AVX-512 or AVX2
+ * where the CPU has them, checked once at run time, and plain C
+ * otherwise. Arrays are separate columns. */
+
+/* Reciprocal lattice positions x, y, z (m^-1) of n reflections, from
+ * their indices and the reciprocal cell given as astar, bstar, cstar in
+ * nine numbers, along with u = x / (k + z) and v = y / (k + z): where
+ * the ray through each crosses the plane z = 1. */
+
+void predict_lattice(const int *h, const int *k, const int *l, size_t n,
+                     const double *cell, double knom,
+                     double *x, double *y, double *z,
+                     double *u, double *v);
+
+/* coefficients per panel in the table for pixels_to_reciprocal() */
+#define PANEL_COEFFS 9
+
+/* Reciprocal space position of n pixels (fs, ss) on the given panels:
+ * the lab frame position from each panel's affine map, three rows of
+ * (fs, ss, 1) coefficients in coeffs, set onto the Ewald sphere of
+ * radius k, with the origin moved to the sphere's surface. rx, ry, rz
+ * come out in whatever units k is in. */
+void pixels_to_reciprocal(const double *coeffs, const int *panels,
+                          const double *fs, const double *ss,
+                          const double *k, size_t n,
+                          double *rx, double *ry, double *rz);
+
+/* coefficients per panel in the table for rays_to_panels(): the nine of
+ * the inverse which takes a ray to (1/mu, fs, ss), then the panel's
+ * width and height in pixels */
+#define RAY_COEFFS 11
+
+/* Where each of n rays (x, y, k + z) crosses the plane of the panel
+ * given for it, in pixels, and whether that is on the panel. The
+ * arithmetic is the same, to the bit, as Predictor's for one ray at a
+ * time, and a NaN position counts as on the panel as it does there.
+ * None of the rays may be all zero. */
+void rays_to_panels(const double *coeffs, const int *panels,
+                    const double *x, const double *y, const double *z,
+                    const double *k, size_t n,
+                    double *fs, double *ss, char *hit);
+
+/* partial sums kept by gaussian_sum(), element i going into i % 8 */
+#define GAUSSIAN_LANES 8
+
+/* Sum of exp(-scale * (x^2 + y^2)) over n points, through a fast exp
+ * which gives the same bits on every version of the kernel, so the
+ * total doesn't depend on the CPU it ran on either. */
+double gaussian_sum(const double *x, const double *y, size_t n,
+                    double scale);
+
+const char *predict_kernel_name();
+
+#endif
@@ -0,0 +1,80 @@
+// slip and slide
+// Copyright (C) 2019 Helen Ginn
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// Please email: vagabond @ hginn.co.uk for more details.
+
+#ifndef __slipnslide__thread_utils__
+#define __slipnslide__thread_utils__
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+inline size_t thread_count()
+{
+	size_t n = std::thread::hardware_concurrency();
+
+	return (n == 0 ? 1 : n);
+}
+
+/* calls func(job) for every job in [0, jobs) on up to the given number of
+ * threads. Jobs are handed out in order, but may finish in any order, so
+ * each job must write only to its own slot of any shared output. */
+template <typename Func>
+void run_jobs(size_t jobs, size_t threads, Func func)
+{
+	if (threads > jobs)
+	{
+		threads = jobs;
+	}
+
+	if (threads <= 1)
+	{
+		for (size_t i = 0; i < jobs; i++)
+		{
+			func(i);
+		}
+
+		return;
+	}
+
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> workers;
+
+	for (size_t i = 0; i < threads; i++)
+	{
+		workers.push_back(std::thread([&]()
+		{
+			while (true)
+			{
+				size_t job = next++;
+				if (job >= jobs)
+				{
+					break;
+				}
+
+				func(job);
+			}
+		}));
+	}
+
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		workers[i].join();
+	}
+}
+
+#endif